@@ -12,10 +12,19 @@
  */
 
 #include <sys/mman.h>
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // since Linux 5.14
+#endif
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <unistd.h>
 
 #include <string>
 #include <chrono> 
 #include <iostream>
+#include <thread>
+#include <condition_variable>
 
 #include "BaseMeta.hpp"
 
@@ -26,6 +35,26 @@
 using namespace std;
 using namespace ralloc;
 using namespace std::chrono;
+
+Counters ralloc::counters;
+uint32_t ralloc::sb_shard_num = 1;
+uint32_t ralloc::sc_max_size = SC_MAX_SIZE;
+uint64_t ralloc::prefault_distance = 0;
+uint32_t ralloc::sb_decommit_watermark = SB_DECOMMIT_WATERMARK;
+std::atomic<int64_t> ralloc::sb_free_committed(0);
+ExtentMap ralloc::free_extents;
+DirtyMap ralloc::sb_dirty;
+
+void PersistBatch::commit(uint64_t flushes, uint64_t fences){
+    drain();
+    FLUSHFENCE;
+    if(fences > 1)
+        counters.fences_saved.fetch_add(fences - 1, std::memory_order_relaxed);
+    if(flushes > flushed)
+        counters.flushes_saved.fetch_add(flushes - flushed, std::memory_order_relaxed);
+    flushed = 0;
+}
+
 template<class T, RegionIndex idx>
 CrossPtr<T,idx>::CrossPtr(T* real_ptr) noexcept{
     if(UNLIKELY(real_ptr == nullptr)){
@@ -183,7 +212,8 @@ void BaseMeta::set_clean(){
 
 BaseMeta::BaseMeta() noexcept
 : 
-    avail_sb(),
+    layout(BASEMETA_LAYOUT),
+    sb_shards(),
     heaps()
     // thread_num(thd_num) {
 {
@@ -192,36 +222,40 @@ BaseMeta::BaseMeta() noexcept
     pthread_mutexattr_setrobust(&dirty_attr, PTHREAD_MUTEX_ROBUST);
     pthread_mutex_init(&dirty_mtx, &dirty_attr);
     set_dirty();
-    FLUSH(&dirty_attr);
-    FLUSH(&dirty_mtx);
+    PersistBatch pb;
+    pb.add(&layout);
+    pb.add(&dirty_attr);
+    pb.add(&dirty_mtx);
     /* heaps init */
     for (size_t idx = 0; idx < MAX_SZ_IDX; ++idx){
         ProcHeap& heap = heaps[idx];
         heap.partial_list.store(nullptr);
         heap.sc_idx = idx;
-        FLUSH(&heaps[idx]);
+        pb.add(&heaps[idx]);
     }
 
     /* persistent roots init */
     for(int i=0;i<MAX_ROOTS;i++){
         roots[i]=nullptr;
-        FLUSH(&roots[i]);
     }
+    pb.add_range(&roots[0], &roots[MAX_ROOTS]);
+    saved_extents = nullptr;
+    pb.add(&saved_extents);
 
-    // warm up small sb space, expanding sb region by SB_REGION_EXPAND_SIZE
+    // align the start of sb space; sbs beyond it are taken one by one from
+    // the frontier of sb region, with their descs constructed then
     void* tmp_sec_start = nullptr;
     int res = 0;
     while (res == 0){
-        res = _rgs->expand(SB_IDX,&tmp_sec_start,SBSIZE, SB_REGION_EXPAND_SIZE);
+        //we skip the first sb on purpose so that CrossPtr doesn't start from 0.
+        //it's huge page aligned, as are sbs every HUGEPAGE_SIZE from it.
+        res = _rgs->expand(SB_IDX,&tmp_sec_start,HUGEPAGE_SIZE, SBSIZE);
         assert(res != -1 && "warmup sb allocation fails!");
     }
-    DBG_PRINT("expand sb space for small sb allocation\n");
     _rgs->regions[SB_IDX]->__store_heap_start(tmp_sec_start);
     _rgs->regions_address[SB_IDX] = (char*)tmp_sec_start;
-    //we skip the first sb on purpose so that CrossPtr doesn't start from 0.
-    tmp_sec_start = (char*)((uint64_t)tmp_sec_start+SBSIZE);
-    organize_sb_list(tmp_sec_start, SB_REGION_EXPAND_SIZE/SBSIZE-1);
-    FLUSHFENCE;
+    // it used to FLUSH each field and root, and fence once here
+    pb.commit(4 + MAX_SZ_IDX + MAX_ROOTS, 1);
 }
 
 // inline void* BaseMeta::expand_sb(size_t sz){
@@ -246,18 +280,27 @@ BaseMeta::BaseMeta() noexcept
 //     return tmp_sec_start;
 // }
 
-//desc of returned sb is constructed
-inline void* BaseMeta::expand_get_large_sb(size_t sz){
+//desc of returned sb is constructed but not persisted; callers fill and
+//persist it anyway
+inline void* BaseMeta::expand_get_sb(size_t sz){
     void* ret = nullptr;
     int res = 0;
+    uint64_t tries = 0;
     while(res == 0) {
         res = _rgs->expand(SB_IDX,&ret,PAGESIZE, sz);
         assert(res != -1 && "space runs out!");
+        tries++;
     }
-    DBG_PRINT("expand sb space for large sb allocation\n");
+    DBG_PRINT("expand sb space for sb allocation\n");
+    extend_descs((char*)ret + sz);
+    if(prefault_distance != 0)
+        prefault_kick((char*)ret + sz);
     
-    Descriptor* desc = desc_lookup(ret);
-    new (desc) Descriptor();
+    new (sb_desc_lookup((char*)ret)) Descriptor(0);
+    // the region allocator used to persist curr_addr before each CAS, and
+    // Descriptor() to persist the desc
+    counters.fences_saved.fetch_add(tries + 1, std::memory_order_relaxed);
+    counters.flushes_saved.fetch_add(tries + 1, std::memory_order_relaxed);
     return ret;
 }
 
@@ -291,6 +334,8 @@ uint32_t BaseMeta::compute_idx(char* superblock, char* block, size_t sc_idx) {
             assert(sc_block_size == block_size);	\
             idx = diff / block_size;				\
             break;
+#define SIZE_CLASS_bin_med(index, block_size)		\
+        SIZE_CLASS_bin_yes(index, block_size)
 #define SIZE_CLASS_bin_no(index, block_size)
 #define SC(index, lg_grp, lg_delta, ndelta, psz, bin, pgs, lg_delta_lookup) \
         SIZE_CLASS_bin_##bin((index + 1), ((1U << lg_grp) + (ndelta << lg_delta)))
@@ -300,6 +345,7 @@ uint32_t BaseMeta::compute_idx(char* superblock, char* block, size_t sc_idx) {
             break;
     }
 #undef SIZE_CLASS_bin_yes
+#undef SIZE_CLASS_bin_med
 #undef SIZE_CLASS_bin_no
 #undef SC
 
@@ -307,113 +353,206 @@ uint32_t BaseMeta::compute_idx(char* superblock, char* block, size_t sc_idx) {
     return idx;
 }
 
+inline char* BaseMeta::carve(char* superblock, uint32_t block_size, uint32_t first, uint32_t num) {
+    char* block = superblock + first * block_size;
+    for (uint32_t i = 1; i < num; i++) {
+        *(pptr<char>*)block = block + block_size;
+        block += block_size;
+    }
+    return block;
+}
+
 void BaseMeta::fill_cache(size_t sc_idx, TCacheBin* cache) {
-    // at most cache will be filled with number of blocks equal to superblock
+    t_caches.register_finalizer();
+    SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
+    // grow the capacity first: a refill means the bin was too small
+    cache->on_fill(sc->cache_min_block_num, sc->cache_block_num);
+    uint32_t const limit = cache->get_limit();
+    counters.cache_fills.fetch_add(1, std::memory_order_relaxed);
+
+    // at most cache will be filled with number of blocks equal to its capacity
+    uint32_t const target = sizeclass.get_fill_target(limit);
     size_t block_num = 0;
-    // use a *SINGLE* partial superblock to try to fill cache
-    malloc_from_partial(sc_idx, cache, block_num);
-    // if we obtain no blocks from partial superblocks, create a new superblock
-    if (block_num == 0)
-        malloc_from_newsb(sc_idx, cache, block_num);
+    // blocks other threads freed for us come first, they cost no anchor CAS
+    if (remote_free) {
+        if (UNLIKELY(!t_caches.remote_tried))
+            remote_attach();
+        if (t_caches.remote_slot != 0)
+            block_num = remote_adopt(sc_idx, cache, limit);
+    }
+    // keep pulling blocks from partial superblocks until target is reached,
+    //  so the slow path is amortized over a predictable number of mallocs
+    while (block_num < target) {
+        size_t got = 0;
+        malloc_from_partial(sc_idx, cache, got, limit - block_num);
+        // if we obtain no blocks from partial superblocks, create a new superblock
+        if (got == 0)
+            malloc_from_newsb(sc_idx, cache, got, limit - block_num);
+        block_num += got;
+    }
 
-    SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
-    (void)sc;
     assert(block_num > 0);
     assert(block_num <= sc->cache_block_num);
+    cache_tick();
 }
 
-void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
-    ProcHeap* heap = &heaps[sc_idx];
+void BaseMeta::cache_overflow(size_t sc_idx, TCacheBin* cache) {
+    t_caches.register_finalizer();
+    SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
+    if (cache->on_overflow(sc->cache_min_block_num, sc->cache_block_num)) {
+        // keep the most recently freed blocks, which are likely still hot
+        uint32_t keep = sizeclass.get_flush_keep(cache->get_limit());
+        if (keep == 0) {
+            counters.cache_full_flushes.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            counters.cache_partial_flushes.fetch_add(1, std::memory_order_relaxed);
+        }
+        flush_cache(sc_idx, cache, keep);
+    }
+    cache_tick();
+}
+
+void BaseMeta::cache_tick() {
+    size_t sc_idx = t_caches.tick();
+    if (LIKELY(sc_idx == 0))
+        return;
+    // shrink a bin that has been idle for a whole decay round, and give back
+    // what no longer fits
+    TCacheBin* cache = &t_caches.t_cache[sc_idx];
+    cache->decay(get_sizeclass_by_idx(sc_idx)->cache_min_block_num);
+    if (cache->get_block_num() > cache->get_limit()) {
+        counters.cache_partial_flushes.fetch_add(1, std::memory_order_relaxed);
+        flush_cache(sc_idx, cache, cache->get_limit());
+    }
+}
+
+void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache, uint32_t keep) {
+    if (cache->get_block_num() <= keep)
+        return;
+    uint32_t block_count = cache->get_block_num() - keep;
+    char* head = cache->split(keep);
+    flush_list(sc_idx, head, block_count);
+}
+
+void BaseMeta::flush_list(size_t sc_idx, char* head, uint32_t block_count) {
+    // blocks in the list may come from many superblocks in arbitrary order,
+    //  so group them by descriptor first and then give each group back with
+    //  a single anchor CAS
+    struct Group {
+        Descriptor* desc;
+        char* head;
+        char* tail;
+        uint32_t count;
+    };
+    Group groups[FLUSH_GROUP_SLOTS];
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < FLUSH_GROUP_SLOTS; i++)
+        groups[i].desc = nullptr;
+
+    char* block = head;
+    for (uint32_t n = 0; n < block_count; n++) {
+        char* next = static_cast<char*>(*(pptr<char>*)block);
+        Descriptor* desc = desc_lookup(block);
+        uint32_t slot = (uint32_t)(((uint64_t)desc >> DESC_SHIFT) & (FLUSH_GROUP_SLOTS - 1));
+        while (groups[slot].desc != nullptr && groups[slot].desc != desc)
+            slot = (slot + 1) & (FLUSH_GROUP_SLOTS - 1);
+        if (groups[slot].desc == nullptr) {
+            if (used == FLUSH_GROUP_SLOTS * 3 / 4) {
+                // too many superblocks at once, give back what we have
+                for (uint32_t i = 0; i < FLUSH_GROUP_SLOTS; i++) {
+                    if (groups[i].desc != nullptr) {
+                        give_back(sc_idx, groups[i].desc, groups[i].head, groups[i].tail, groups[i].count);
+                        groups[i].desc = nullptr;
+                    }
+                }
+                used = 0;
+                slot = (uint32_t)(((uint64_t)desc >> DESC_SHIFT) & (FLUSH_GROUP_SLOTS - 1));
+            }
+            groups[slot].desc = desc;
+            groups[slot].head = block;
+            groups[slot].tail = block;
+            groups[slot].count = 1;
+            used++;
+        } else {
+            // prepend block to its group
+            *(pptr<char>*)block = groups[slot].head;
+            groups[slot].head = block;
+            groups[slot].count++;
+        }
+        block = next;
+    }
+
+    for (uint32_t i = 0; i < FLUSH_GROUP_SLOTS; i++) {
+        if (groups[i].desc != nullptr)
+            give_back(sc_idx, groups[i].desc, groups[i].head, groups[i].tail, groups[i].count);
+    }
+}
+
+void BaseMeta::give_back(size_t sc_idx, Descriptor* desc, char* head, char* tail, uint32_t block_count) {
     SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
-    uint32_t const sb_size = sc->sb_size;
     uint32_t const block_size = sc->block_size;
     // after CAS, desc might become empty and
     //  concurrently reused, so store maxcount
     uint32_t const maxcount = sc->get_block_num();
     (void)maxcount; // suppress unused warning
+    char* superblock = static_cast<char*>(desc->superblock);
 
-    // @todo: optimize
-    // in the normal case, we should be able to return several
-    //  blocks with a single CAS
-    while (cache->get_block_num() > 0) {
-        char* head = cache->peek_block();
-        char* tail = head;
-        Descriptor* desc = desc_lookup(head);
-        char* superblock = static_cast<char*>(desc->superblock);
-
-        // cache is a linked list of blocks
-        // superblock free list is also a linked list of blocks
-        // can optimize transfers of blocks between these 2 entities
-        //  by exploiting existing structure
-        uint32_t block_count = 1;
-        // check if next cache blocks are in the same superblock
-        // same superblock, same descriptor
-        while (cache->get_block_num() > block_count) {
-            char* ptr = static_cast<char*>(*(pptr<char>*)tail);
-            if (ptr < superblock || ptr >= superblock + sb_size)
-                break; // ptr not in superblock
-
-            // ptr in superblock, add to "list"
-            ++block_count;
-            tail = ptr;
-        }
-
-        cache->pop_list(static_cast<char*>(*(pptr<char>*)tail), block_count);
-
-        // add list to desc, update anchor
-        uint32_t idx = compute_idx(superblock, head, sc_idx);
+    // add list to desc, update anchor
+    uint32_t idx = compute_idx(superblock, head, sc_idx);
 
-        Anchor oldanchor = desc->anchor.load();
-        Anchor newanchor;
-        do {
-            // update anchor.avail
+    Anchor oldanchor = desc->anchor.load();
+    Anchor newanchor;
+    do {
+        // update anchor.avail
+        // the list is bounded by anchor.count, so the link of tail only
+        //  matters if the superblock still has available blocks
+        if (oldanchor.count > 0) {
+            if (tail == nullptr) {
+                tail = head;
+                for (uint32_t i = 1; i < block_count; i++)
+                    tail = static_cast<char*>(*(pptr<char>*)tail);
+            }
             char* next = (char*)(superblock + oldanchor.avail * block_size);
             *(pptr<char>*)tail = next;
+        }
 
-            newanchor = oldanchor;
-            newanchor.avail = idx;
-            // state updates
-            // don't set SB_PARTIAL if state == SB_ACTIVE
-            if (oldanchor.state == SB_FULL)
-                newanchor.state = SB_PARTIAL;
-            // this can't happen with SB_ACTIVE
-            // because of reserved blocks
-            assert(oldanchor.count < desc->maxcount);
-            if (oldanchor.count + block_count == desc->maxcount) {
-                newanchor.count = desc->maxcount - 1;
-                newanchor.state = SB_EMPTY; // can free superblock
-            }
-            else
-                newanchor.count += block_count;
+        newanchor = oldanchor;
+        newanchor.avail = idx;
+        // state updates
+        // don't set SB_PARTIAL if state == SB_ACTIVE
+        if (oldanchor.state == SB_FULL)
+            newanchor.state = SB_PARTIAL;
+        // this can't happen with SB_ACTIVE
+        // because of reserved blocks
+        assert(oldanchor.count < desc->maxcount);
+        // blocks beyond the frontier are free as well
+        if (oldanchor.count + block_count + (desc->maxcount - oldanchor.frontier) == desc->maxcount) {
+            newanchor.count = desc->maxcount - 1;
+            newanchor.state = SB_EMPTY; // can free superblock
         }
-        while (!desc->anchor.compare_exchange_weak(oldanchor, newanchor));
-
-        // after last CAS, can't reliably read any desc fields
-        // as desc might have become empty and been concurrently reused
-        assert(oldanchor.avail < maxcount || oldanchor.state == SB_FULL);
-        assert(newanchor.avail < maxcount);
-        assert(newanchor.count < maxcount);
-
-        // CAS success
-        if (oldanchor.state == SB_FULL) {
-            if(newanchor.state == SB_EMPTY) {
-                // this sb becomes empty from full
-                small_sb_retire(superblock, SBSIZE);
-            } else {
-                // this sb becomes partial from full
-                heap_push_partial(desc);
-            }
+        else
+            newanchor.count += block_count;
+    }
+    while (!desc->anchor.compare_exchange_weak(oldanchor, newanchor));
+
+    // after last CAS, can't reliably read any desc fields
+    // as desc might have become empty and been concurrently reused
+    assert(oldanchor.avail < maxcount || oldanchor.count == 0);
+    assert(newanchor.avail < maxcount);
+    assert(newanchor.count < maxcount);
+
+    // CAS success
+    if (oldanchor.state == SB_FULL) {
+        if(newanchor.state == SB_EMPTY) {
+            // this sb becomes empty from full
+            sc_sb_retire(superblock, sc->sb_size);
+        } else {
+            // this sb becomes partial from full
+            heap_push_partial(desc);
         }
     }
 }
 
-Descriptor* BaseMeta::desc_lookup(const char* ptr){
-    uint64_t sb_index = (((uint64_t)ptr)>>SB_SHIFT) - (((uint64_t)_rgs->lookup(SB_IDX))>>SB_SHIFT); // the index of sb this block in
-    Descriptor* ret = reinterpret_cast<Descriptor*>(_rgs->lookup(DESC_IDX));
-    ret+=sb_index;
-    return ret;
-}
-
 char* BaseMeta::sb_lookup(Descriptor* desc){
     uint64_t desc_index = (((uint64_t)desc)>>DESC_SHIFT) - (((uint64_t)_rgs->lookup(DESC_IDX))>>DESC_SHIFT); // the index of sb this block in
     char* ret = _rgs->lookup(SB_IDX);
@@ -422,7 +561,7 @@ char* BaseMeta::sb_lookup(Descriptor* desc){
 }
 
 void BaseMeta::heap_push_partial(Descriptor* desc) {
-    ProcHeap* heap = desc->heap;
+    ProcHeap* heap = &heaps[desc->sc_idx];
     ptr_cnt<Descriptor> oldhead = heap->partial_list.load();
     ptr_cnt<Descriptor> newhead;
     do {
@@ -447,7 +586,7 @@ Descriptor* BaseMeta::heap_pop_partial(ProcHeap* heap) {
     return oldhead.get_ptr();
 }
 
-void BaseMeta::malloc_from_partial(size_t sc_idx, TCacheBin* cache, size_t& block_num){
+void BaseMeta::malloc_from_partial(size_t sc_idx, TCacheBin* cache, size_t& block_num, uint32_t want){
 retry:
     ProcHeap* heap = &heaps[sc_idx];
 
@@ -458,6 +597,7 @@ retry:
     // reserve block(s)
     Anchor oldanchor = desc->anchor.load();
     Anchor newanchor;
+    uint32_t carve_num;
     uint32_t maxcount = desc->maxcount;
     uint32_t block_size = desc->block_size;
     char* superblock = desc->superblock;
@@ -466,7 +606,7 @@ retry:
     // due to free()
     do {
         if (oldanchor.state == SB_EMPTY) {
-            small_sb_retire(superblock, get_sizeclass(heap)->sb_size);
+            sc_sb_retire(superblock, get_sizeclass(heap)->sb_size);
             goto retry;
         }
 
@@ -481,12 +621,21 @@ retry:
         newanchor.count = 0;
         // avail value doesn't actually matter
         newanchor.avail = maxcount;
-        newanchor.state = SB_FULL;
+        // carve what the list falls short of from the frontier
+        carve_num = 0;
+        if (oldanchor.count < want)
+            carve_num = min(want - (uint32_t)oldanchor.count,
+                maxcount - (uint32_t)oldanchor.frontier);
+        newanchor.frontier = oldanchor.frontier + carve_num;
+        // blocks left beyond the frontier keep it partial, and we put it
+        //  back to the partial list
+        newanchor.state = newanchor.frontier < maxcount ? SB_PARTIAL : SB_FULL;
     }
     while (!desc->anchor.compare_exchange_weak(
                 oldanchor, newanchor));
+    mark_dirty(superblock, get_sizeclass(heap)->sb_size);
 
-    // will take as many blocks as available from superblock
+    // will take as many blocks as the cache can hold from superblock
     // *AND* no thread can do malloc() using this superblock, we
     //  exclusively own it
     // if CAS fails, it just means another thread added more available blocks
@@ -494,177 +643,461 @@ retry:
     uint32_t block_take = oldanchor.count;
     uint32_t avail = oldanchor.avail;
 
-    assert(avail < maxcount);
-    char* block = superblock + avail * block_size;
+    char* block = nullptr;
+    char* tail = nullptr;
+    if (block_take > 0) {
+        assert(avail < maxcount);
+        block = superblock + avail * block_size;
+        if (block_take > want || carve_num > 0 || cache->get_block_num() > 0) {
+            // find the last block we take, to link it to cached or carved
+            //  blocks
+            tail = block;
+            for (uint32_t i = 1; i < min(block_take, want); i++)
+                tail = static_cast<char*>(*(pptr<char>*)tail);
+        }
+    }
+    if (carve_num > 0) {
+        char* carved = superblock + oldanchor.frontier * block_size;
+        char* carved_tail = carve(superblock, block_size, oldanchor.frontier, carve_num);
+        if (tail != nullptr)
+            *(pptr<char>*)tail = carved;
+        else
+            block = carved;
+        tail = carved_tail;
+        block_take += carve_num;
+    }
+    if (newanchor.state == SB_PARTIAL)
+        heap_push_partial(desc);
+    if (block_take > want) {
+        // split the list and give the rest back to the superblock
+        char* rest = static_cast<char*>(*(pptr<char>*)tail);
+        give_back(sc_idx, desc, rest, nullptr, block_take - want);
+        block_take = want;
+    }
+    desc->owner.store(t_caches.remote_slot, std::memory_order_relaxed);
 
-    // cache must be empty at this point
-    // and the blocks are already organized as a list
-    // so all we need do is "push" that list, a constant time op
-    assert(cache->get_block_num() == 0);
-    cache->push_list(block, block_take);
+    // the blocks are already organized as a list
+    // so all we need do is "push" that list
+    cache->push_list(block, tail, block_take);
 
     block_num += block_take;
 }
 
-void BaseMeta::malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_num) {
-    ProcHeap* heap = &heaps[sc_idx];
+void BaseMeta::malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_num, uint32_t want) {
     SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
     uint32_t const block_size = sc->block_size;
     uint32_t const maxcount = sc->get_block_num();
 
-    char* superblock = reinterpret_cast<char*>(small_sb_alloc(sc->sb_size));
+    char* superblock = reinterpret_cast<char*>(sc_sb_alloc(sc->sb_size));
     assert(superblock);
+    mark_dirty(superblock, sc->sb_size);
     Descriptor* desc = desc_lookup(superblock);
 
-    desc->heap = heap;
+    desc->sc_idx = sc_idx;
     desc->block_size = block_size;
     desc->maxcount = maxcount;
     desc->superblock = superblock;
+    desc->owner.store(t_caches.remote_slot, std::memory_order_relaxed);
 
-    // prepare block list
-    for (uint32_t idx = 0; idx < maxcount - 1; ++idx) {
-        pptr<char>* block = (pptr<char>*)(superblock + idx * block_size);
-        char* next = superblock + (idx + 1) * block_size;
-        *block = next;
-    }
-
-    // push blocks to thread local cache
+    // push blocks to thread local cache, up to its capacity; only they are
+    //  carved, and the rest stays untouched beyond the frontier
+    uint32_t const block_take = min(want, maxcount);
     char* block = superblock; // first block
-    cache->push_list(block, maxcount);
+    cache->push_list(block, carve(superblock, block_size, 0, block_take), block_take);
 
     Anchor anchor;
     anchor.avail = maxcount;
     anchor.count = 0;
-    anchor.state = SB_FULL;
+    anchor.frontier = block_take;
+    anchor.state = block_take < maxcount ? SB_PARTIAL : SB_FULL;
     desc->anchor.store(anchor);
 
     FLUSH(desc);
     FLUSHFENCE;
 
-    assert(anchor.avail < maxcount || anchor.state == SB_FULL);
-    assert(anchor.count < maxcount);
-
     // if state changes to SB_PARTIAL, desc must be added to partial list
-    assert(anchor.state == SB_FULL);
+    if (anchor.state == SB_PARTIAL)
+        heap_push_partial(desc);
 
-    block_num += maxcount;
+    block_num += block_take;
 }
 
-//for sb in the free list, their desc are all constructed.
-inline void BaseMeta::organize_sb_list(void* start, uint64_t count){
-    // put (start)...(start+count-1) sbs to free_sb queue
-    // in total it's count sbs
-    Descriptor* desc_start = desc_lookup((char*)((uint64_t)start));
-    Descriptor* desc = desc_start;
-    new (desc) Descriptor();
-    for(uint64_t i = 1; i < count; i++){
-        desc->next_free.store(desc+1);//pptr
-        desc++;
-        new (desc) Descriptor();
-    }
+inline uint32_t BaseMeta::local_sb_shard(){
+    if(ralloc::sb_shard_num == 1) return 0;
+    int cpu = sched_getcpu();
+    if(UNLIKELY(cpu < 0)) return 0;
+    return (uint32_t)cpu % ralloc::sb_shard_num;
+}
+
+inline void BaseMeta::sb_push(uint32_t shard, Descriptor* first, Descriptor* last){
+    AtomicCrossPtrCnt<Descriptor, DESC_IDX>& avail_sb = sb_shards[shard].avail_sb;
     ptr_cnt<Descriptor> oldhead = avail_sb.load();
     ptr_cnt<Descriptor> newhead;
     do{
-        desc->next_free.store(oldhead.get_ptr());
-        newhead.set(desc_start, oldhead.get_counter()+1);
+        last->next_free.store(oldhead.get_ptr());
+        newhead.set(first, oldhead.get_counter()+1);
     }while(!avail_sb.compare_exchange_weak(oldhead,newhead));
 }
 
+inline Descriptor* BaseMeta::sb_pop(uint32_t shard){
+    AtomicCrossPtrCnt<Descriptor, DESC_IDX>& avail_sb = sb_shards[shard].avail_sb;
+    ptr_cnt<Descriptor> oldhead = avail_sb.load();
+    while(oldhead.get_ptr() != nullptr){
+        Descriptor* oldptr = oldhead.get_ptr();
+        ptr_cnt<Descriptor> newhead;
+        newhead.set(oldptr->next_free.load(),oldhead.get_counter());
+        if(avail_sb.compare_exchange_strong(oldhead,newhead)){
+            return oldptr;
+        }
+    }
+    return nullptr;
+}
+
+void BaseMeta::fold_sb_shards(){
+    int64_t committed = 0;
+    for(uint32_t i = 0; i < MAX_SB_SHARDS; i++){
+        Descriptor* first = sb_shards[i].avail_sb.load().get_ptr();
+        if(first == nullptr) continue;
+        Descriptor* last = first;
+        while(true){
+            if(!(last->flags & DESC_ZEROED)) committed++;
+            if(last->next_free.load() == nullptr) break;
+            last = last->next_free.load();
+        }
+        if(i >= ralloc::sb_shard_num){
+            sb_shards[i].avail_sb.store(ptr_cnt<Descriptor>(nullptr, 0));
+            sb_push(i % ralloc::sb_shard_num, first, last);
+        }
+    }
+    sb_free_committed.fetch_add(committed);
+}
+
+void BaseMeta::sb_usage(uint64_t* logical, uint64_t* resident){
+    char* start = _rgs->lookup(SB_IDX);
+    char* end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    *logical = (uint64_t)(end - start);
+    *resident = 0;
+    // query mincore by chunks to bound the vector
+    const uint64_t chunk = 64*1024*1024ULL;
+    std::vector<unsigned char> vec(chunk/PAGESIZE);
+    for(char* addr = start; addr < end; addr += chunk){
+        uint64_t len = min(chunk, (uint64_t)(end - addr));
+        if(mincore(addr, len, vec.data()) != 0) continue;
+        for(uint64_t i = 0; i < (len + PAGESIZE - 1)/PAGESIZE; i++)
+            *resident += (vec[i] & 1) * PAGESIZE;
+    }
+}
+
+// populate page tables of [start, end) so that writes to it take no fault
+static void populate(char* start, char* end){
+    if(madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+        return;
+    // unsupported before Linux 5.14; write to each page without changing it,
+    // as it may be taken into use meanwhile
+    for(char* p = start; p < end; p += PAGESIZE)
+        __atomic_fetch_add(reinterpret_cast<uint64_t*>(p), 0, __ATOMIC_RELAXED);
+}
+
+void BaseMeta::extend_descs(char* sb_end){
+    char* desc_end = (char*)(sb_desc_lookup(sb_end - 1) + 1);
+    int res = _rgs->extend_to(DESC_IDX, desc_end);
+    assert(res != -1 && "space runs out!");
+}
+
+char* BaseMeta::prefault_ahead(char* populated, uint64_t distance){
+    RegionManager* sb_region = _rgs->regions[SB_IDX];
+    RegionManager* desc_region = _rgs->regions[DESC_IDX];
+    char* sb_start = _rgs->lookup(SB_IDX);
+    char* frontier = sb_region->curr_addr_ptr->load();
+    char* start = std::max(populated, frontier);
+    char* end = std::min(frontier + distance, sb_region->base_addr + sb_region->FILESIZE);
+    if(start >= end)
+        return populated;
+    start = (char*)round_up((uint64_t)start, PAGESIZE);
+    end = (char*)round_up((uint64_t)end, PAGESIZE);
+    populate(start, end);
+    // descs of those sbs, one per SBSIZE bytes
+    char* desc_start = _rgs->lookup(DESC_IDX);
+    char* desc_end = desc_region->base_addr + desc_region->FILESIZE;
+    char* dstart = desc_start + (start - sb_start)/SBSIZE*DESCSIZE;
+    char* dend = std::min(desc_start + round_up(end - sb_start, SBSIZE)/SBSIZE*DESCSIZE, desc_end);
+    dstart = (char*)((uint64_t)dstart & ~PAGE_MASK);
+    dend = (char*)round_up((uint64_t)dend, PAGESIZE);
+    if(dstart < dend)
+        populate(dstart, dend);
+    counters.prefault_bytes.fetch_add((end - start) + (dend - dstart), std::memory_order_relaxed);
+    return end;
+}
+
+void BaseMeta::save_extents(){
+    Descriptor* head = nullptr;
+    free_extents.for_each([&](char* start, uint64_t len){
+        Descriptor* desc = desc_lookup(start);
+        desc->next_free.store(head);
+        desc->block_size = len/SBSIZE;
+        FLUSH(desc);
+        head = desc;
+    });
+    FLUSHFENCE;
+    saved_extents = head;
+    FLUSH(&saved_extents);
+    FLUSHFENCE;
+}
+
+void BaseMeta::load_extents(){
+    Descriptor* desc = saved_extents;
+    int64_t committed = 0;
+    while(desc != nullptr){
+        for(uint32_t i = 0; i < desc->block_size; i++)
+            committed += !(desc[i].flags & DESC_ZEROED);
+        free_extents.insert(sb_lookup(desc), (uint64_t)desc->block_size*SBSIZE);
+        desc = desc->next_free.load();
+    }
+    sb_free_committed.fetch_add(committed);
+    // extents are transient from now on
+    saved_extents = nullptr;
+    FLUSH(&saved_extents);
+    FLUSHFENCE;
+}
+
+void BaseMeta::mark_used_sbs(){
+    char* start = _rgs->lookup(SB_IDX);
+    char* end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    char* sb = start;
+    while(sb < end){
+        Descriptor* desc = sb_desc_lookup(sb);
+        // free sbs have maxcount 0, and so do interior ones of spans
+        if(desc->maxcount == 0 && !(desc->flags & DESC_INTERIOR)){
+            sb += SBSIZE;
+            continue;
+        }
+        // a large block takes all its sbs, whose descs are left as is
+        uint64_t size = SBSIZE;
+        if(desc->maxcount != 0 && desc->sc_idx == 0)
+            size = std::max((uint64_t)desc->block_size, (uint64_t)SBSIZE);
+        sb_dirty.mark((sb - start)/SBSIZE, size/SBSIZE);
+        sb += size;
+    }
+}
+
+uint64_t BaseMeta::flush_heap(uint32_t thread_num){
+    char* sb_start = _rgs->lookup(SB_IDX);
+    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    char* desc_start = _rgs->lookup(DESC_IDX);
+    char* desc_end = _rgs->regions[DESC_IDX]->curr_addr_ptr->load();
+    // a task is the sbs of a word of sb_dirty, or as many bytes of descs
+    const uint64_t chunk = 64*SBSIZE;
+    uint64_t sb_tasks = (sb_end - sb_start + chunk - 1)/chunk;
+    uint64_t tasks = sb_tasks + (desc_end - desc_start + chunk - 1)/chunk;
+    std::atomic<uint64_t> next_task(0);
+    std::atomic<uint64_t> flushed(0);
+    auto worker = [&](){
+        uint64_t bytes = 0;
+        uint64_t i;
+        while((i = next_task.fetch_add(1, std::memory_order_relaxed)) < tasks){
+            if(i >= sb_tasks){
+                char* start = desc_start + (i - sb_tasks)*chunk;
+                char* end = std::min(start + chunk, desc_end);
+                pwb_range(start, end);
+                bytes += end - start;
+                continue;
+            }
+            for(uint64_t dirty = sb_dirty.word(i); dirty != 0; dirty &= dirty - 1){
+                char* sb = sb_start + (i*64 + __builtin_ctzll(dirty))*SBSIZE;
+                char* end = std::min(sb + SBSIZE, sb_end);
+                pwb_range(sb, end);
+                bytes += end - sb;
+            }
+        }
+        // fence flushes of this thread before it's joined
+        FLUSHFENCE;
+        flushed.fetch_add(bytes, std::memory_order_relaxed);
+    };
+    thread_num = (uint32_t)std::min((uint64_t)std::max(thread_num, 1U), std::max(tasks, (uint64_t)1));
+    std::vector<std::thread> pool;
+    for(uint32_t i = 1; i < thread_num; i++)
+        pool.emplace_back(worker);
+    worker();
+    for(auto& t : pool)
+        t.join();
+    return flushed.load();
+}
+
+bool BaseMeta::take_sbs(Descriptor* first, uint64_t count){
+    int64_t committed = 0;
+    bool zeroed = false;
+    for(Descriptor* desc = first; desc < first + count; desc++){
+        if(desc->flags & DESC_ZEROED){
+            desc->flags = 0;
+            FLUSH(&desc->flags);
+            zeroed = true;
+        } else {
+            committed++;
+        }
+    }
+    if(zeroed){
+        // persist the clear before the sbs get data, or GC may take a stale
+        // flag as the sb reading zero
+        FLUSHFENCE;
+    }
+    if(committed != 0)
+        sb_free_committed.fetch_sub(committed, std::memory_order_relaxed);
+    return committed == 0;
+}
+
+void BaseMeta::extent_to_shard(char* start, uint64_t count){
+    Descriptor* first = desc_lookup(start);
+    Descriptor* desc = first;
+    for(uint64_t i = 0; i < count; i++, desc++){
+        uint32_t flags = desc->flags;
+        new (desc) Descriptor(flags);
+        if(i + 1 < count)
+            desc->next_free.store(desc+1);//pptr
+    }
+    pwb_range(first, first + count);
+    FLUSHFENCE;
+    sb_push(local_sb_shard(), first, first + count - 1);
+}
+
+bool BaseMeta::sb_decommit(void* sb, uint64_t count){
+    if(sb_decommit_watermark == 0){
+        sb_free_committed.fetch_add(count, std::memory_order_relaxed);
+        return false;
+    }
+    int64_t committed = sb_free_committed.fetch_add(count, std::memory_order_relaxed) + count;
+    if(committed <= (int64_t)sb_decommit_watermark)
+        return false;
+    // frees the blocks of the file backing the range, on tmpfs and DAX alike;
+    // keep them committed if it's unsupported
+    if(madvise(sb, count*SBSIZE, MADV_REMOVE) != 0)
+        return false;
+    // nothing is left to write back, and flushing would fault it back in
+    sb_dirty.clear(((char*)sb - _rgs->lookup(SB_IDX))/SBSIZE, count);
+    sb_free_committed.fetch_sub(count, std::memory_order_relaxed);
+    counters.sb_decommits.fetch_add(count, std::memory_order_relaxed);
+    return true;
+}
+
 void* BaseMeta::small_sb_alloc(size_t size){
     if(size != SBSIZE){
         std::cout<<"desired size: "<<size<<std::endl;
         assert(0);
     }
 
-    Descriptor* oldptr = nullptr;
-
-    ptr_cnt<Descriptor> oldhead = avail_sb.load();
+    uint32_t shard = local_sb_shard();
     while(true){
-        oldptr = oldhead.get_ptr();
+        Descriptor* oldptr = sb_pop(shard);
+        // local shard is empty, steal from others before expanding
+        for(uint32_t i = 1; oldptr == nullptr && i < ralloc::sb_shard_num; i++){
+            oldptr = sb_pop((shard + i) % ralloc::sb_shard_num);
+            if(oldptr != nullptr)
+                counters.sb_steals.fetch_add(1, std::memory_order_relaxed);
+        }
         if(oldptr) {
-            ptr_cnt<Descriptor> newhead;
-            newhead.set(oldptr->next_free.load(),oldhead.get_counter());
-            if(avail_sb.compare_exchange_strong(oldhead,newhead)){
-                return reinterpret_cast<void*>(sb_lookup(oldptr));
-            }
+            take_sbs(oldptr, 1);
+            return reinterpret_cast<void*>(sb_lookup(oldptr));
         }
-        else{
-            // below is effectively _rgs->regions[SB_IDX](&tmp_sec_start,PAGESIZE, SB_REGION_EXPAND_SIZE);
-            char* next;
-            char* res = nullptr;
-            char * old_curr_addr = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
-            char * new_curr_addr = old_curr_addr;
-            size_t aln_adj = (size_t) new_curr_addr & (PAGESIZE - 1);
-            if(aln_adj != 0)
-                new_curr_addr += (PAGESIZE - aln_adj);
-            res = new_curr_addr;
-            next = new_curr_addr + SB_REGION_EXPAND_SIZE;
-            if (avail_sb.load().get_ptr() != nullptr){
-                // ensure this expansion is necessary
-                continue;
-            }
-            if (next > _rgs->regions[SB_IDX]->base_addr + _rgs->regions[SB_IDX]->FILESIZE){
-                printf("\n----Region Manager: out of space in mmaped file-----\nCurr:%p\nBase:%p\n",res,_rgs->regions[SB_IDX]->base_addr);
-                assert(0);
-            }
-            new_curr_addr = next;
-            FLUSH(_rgs->regions[SB_IDX]->curr_addr_ptr);
-            FLUSHFENCE;
-            if(_rgs->regions[SB_IDX]->curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)){
-                FLUSH(_rgs->regions[SB_IDX]->curr_addr_ptr);
-                FLUSHFENCE;
-                DBG_PRINT("expand sb space for small sb allocation\n");
-                organize_sb_list((char*)((uint64_t)res+SBSIZE), SB_REGION_EXPAND_SIZE/SBSIZE-1);
-                Descriptor* desc = desc_lookup(res);
-                new (desc) Descriptor();
-                return (void*)res;
-            }
-            // CAS fails. Try to get a sb from free list again.
+        // then carve a batch out of free extents
+        uint64_t len = 0;
+        char* start = free_extents.take_smallest(SB_EXTENT_BATCH*SBSIZE, &len);
+        if(start != nullptr) {
+            extent_to_shard(start, len/SBSIZE);
+            continue;
         }
+        // last, take a never used sb from the frontier of sb region
+        return expand_get_sb(SBSIZE);
+    }
+}
+void* BaseMeta::span_alloc(size_t size){
+    char* span = reinterpret_cast<char*>(large_sb_alloc(size));
+    Descriptor* head = desc_lookup(span);
+    for(uint64_t i = 1; i < size/SBSIZE; i++){
+        // only superblock and flags matter for interior descs
+        head[i].superblock = span;
+        head[i].flags = DESC_INTERIOR;
     }
+    // persist them before any block of the span is handed out
+    PersistBatch pb;
+    pb.add_range(head + 1, head + size/SBSIZE);
+    pb.commit();
+    return span;
+}
+
+inline void* BaseMeta::sc_sb_alloc(size_t sb_size){
+    if(sb_size == SBSIZE)
+        return small_sb_alloc(sb_size);
+    return span_alloc(sb_size);
+}
+
+inline void BaseMeta::sc_sb_retire(void* sb, size_t sb_size){
+    if(sb_size == SBSIZE)
+        small_sb_retire(sb, sb_size);
+    else // back to free extents, clearing DESC_INTERIOR
+        large_sb_retire(sb, sb_size);
 }
+
 inline void BaseMeta::small_sb_retire(void* sb, size_t size){
     assert(size == SBSIZE);
     Descriptor* desc = desc_lookup(sb);
     new (desc) Descriptor(); // at this time we erase data in this desc
-    ptr_cnt<Descriptor> oldhead = avail_sb.load();
-    ptr_cnt<Descriptor> newhead;
-    do{
-        desc->next_free.store(oldhead.get_ptr());
-        newhead.set(desc, oldhead.get_counter()+1);
-    } while (!avail_sb.compare_exchange_weak(oldhead,newhead));
+    if(sb_decommit(sb, 1)){
+        // losing this on crash only makes the sb counted as committed
+        desc->flags = DESC_ZEROED;
+    }
+    sb_push(local_sb_shard(), desc, desc);
 }
 
 /* 
- * IMPORTANT: 	Large_sb_alloc is designed for very rare 
- *				large sb (>=16K) allocations. 
- *
- *				Every time sb region will be expanded by $size$
+ * Large sbs take the best fitting free extent, and sb region will be
+ * expanded by $size$ only if there's none.
  */
-inline void* BaseMeta::large_sb_alloc(size_t size){
-    // cout<<"WARNING: Allocating a large object.\n";
-    return expand_get_large_sb(size);
+inline void* BaseMeta::large_sb_alloc(size_t size, bool* zeroed){
+    char* ret = free_extents.take(size);
+    if(ret != nullptr){
+        bool all_zeroed = take_sbs(desc_lookup(ret), size/SBSIZE);
+        if(zeroed != nullptr) *zeroed = all_zeroed;
+        // persisted by the caller, as in expand_get_sb()
+        new (desc_lookup(ret)) Descriptor(0);
+        counters.fences_saved.fetch_add(1, std::memory_order_relaxed);
+        counters.flushes_saved.fetch_add(1, std::memory_order_relaxed);
+        return ret;
+    }
+    // sbs beyond the frontier have never been touched
+    if(zeroed != nullptr) *zeroed = true;
+    return expand_get_sb(size);
 }
 
 void BaseMeta::large_sb_retire(void* sb, size_t size){
     // cout<<"WARNING: Deallocating a large object.\n";
     assert(size%SBSIZE == 0);//size must be a multiple of SBSIZE
-    organize_sb_list(sb, size/SBSIZE);
+    uint64_t count = size/SBSIZE;
+    uint32_t flags = sb_decommit(sb, count) ? (uint32_t)DESC_ZEROED : 0;
+    // free the head desc first so that GC won't see the extent in use
+    Descriptor* desc = desc_lookup(sb);
+    new (desc) Descriptor(flags);
+    FLUSH(desc);
+    FLUSHFENCE;
+    for(uint64_t i = 1; i < count; i++)
+        new (desc+i) Descriptor(flags);
+    pwb_range(desc + 1, desc + count);
+    FLUSHFENCE;
+    free_extents.insert((char*)sb, size);
 }
 
-inline void* BaseMeta::alloc_large_block(size_t sz){
-    return large_sb_alloc(sz);
+inline void* BaseMeta::alloc_large_block(size_t sz, bool* zeroed){
+    return large_sb_alloc(sz, zeroed);
 }
 
-void* BaseMeta::do_malloc(size_t size){
-    if (UNLIKELY(size > MAX_SZ)) {
+void* BaseMeta::do_malloc(size_t size, bool* zeroed){
+    if (UNLIKELY(size > sc_max_size)) {
         // large block allocation
         size_t sbs = round_up(size, SBSIZE);//round size up to multiple of SBSIZE
-        char* ptr = (char*)alloc_large_block(sbs);
+        char* ptr = (char*)alloc_large_block(sbs, zeroed);
         assert(ptr);
+        mark_dirty(ptr, sbs);
         Descriptor* desc = desc_lookup(ptr);
 
-        desc->heap = &heaps[0];
+        desc->sc_idx = 0;
         desc->block_size = sbs;
         desc->maxcount = 1;
         desc->superblock = ptr;
@@ -675,7 +1108,7 @@ void* BaseMeta::do_malloc(size_t size){
         anchor.state = SB_FULL;
         desc->anchor.store(anchor);
 
-        FLUSH(&desc);
+        FLUSH(desc);
         FLUSHFENCE;
 
         DBG_PRINT("large, ptr: %p", ptr);
@@ -699,7 +1132,7 @@ void BaseMeta::do_free(void* ptr){
     // @todo: this can happen with dynamic loading
     // need to print correct message
 
-    size_t sc_idx = desc->heap->sc_idx;
+    size_t sc_idx = desc->sc_idx;
     // DBG_PRINT("Desc %p, ptr %p", desc, ptr);
 
     // large allocation case
@@ -710,20 +1143,305 @@ void BaseMeta::do_free(void* ptr){
         return;
     }
 
+    // hand the block over to the thread it came from
+    if (remote_free) {
+        uint32_t owner = desc->owner.load(std::memory_order_relaxed);
+        if (owner != 0 && owner != t_caches.remote_slot) {
+            remote_free_block(sc_idx, owner, (char*)ptr);
+            return;
+        }
+    }
+
     TCacheBin* cache = &t_caches.t_cache[sc_idx];
-    SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
 
     // flush cache if need
-    if (UNLIKELY(cache->get_block_num() >= sc->cache_block_num))
-        flush_cache(sc_idx, cache);
+    if (UNLIKELY(cache->get_block_num() >= cache->get_limit()))
+        cache_overflow(sc_idx, cache);
 
     cache->push_block((char*)ptr);
 }
 
+void BaseMeta::do_free_sized(void* ptr, size_t size){
+    if(ptr==nullptr) return;
+    // whether a size over MAX_SMALL_SZ got a size class depends on the
+    // sc_max_size of the run that allocated it, so ask the descriptor;
+    // remote free needs the descriptor anyway
+    if (UNLIKELY(size > MAX_SMALL_SZ || remote_free)) {
+        do_free(ptr);
+        return;
+    }
+    assert(_rgs->in_range(SB_IDX,ptr));
+    size_t sc_idx = get_sizeclass(size);
+#ifdef DEBUG
+    // size must map to the size class ptr is allocated from
+    assert(desc_lookup(ptr)->sc_idx == sc_idx && "size mismatches block!");
+#endif
+
+    TCacheBin* cache = &t_caches.t_cache[sc_idx];
+
+    // flush cache if need
+    if (UNLIKELY(cache->get_block_num() >= cache->get_limit()))
+        cache_overflow(sc_idx, cache);
+
+    cache->push_block((char*)ptr);
+}
+
+void BaseMeta::remote_attach() {
+    t_caches.remote_tried = true;
+    for (uint32_t i = 0; i < REMOTE_SLOTS; i++) {
+        bool expected = false;
+        if (remote_slots[i].in_use.load(std::memory_order_relaxed))
+            continue;
+        if (remote_slots[i].in_use.compare_exchange_strong(expected, true)) {
+            t_caches.remote_slot = i + 1;
+            return;
+        }
+    }
+    // all slots are taken; this thread keeps using the local path only
+}
+
+void BaseMeta::remote_free_block(size_t sc_idx, uint32_t owner, char* block) {
+    t_caches.register_finalizer();
+    RemoteBatch* batch = t_caches.remote_batch(owner, sc_idx);
+    if (batch->count > 0 && (batch->owner != owner || batch->sc_idx != sc_idx))
+        remote_publish(batch);
+    batch->owner = owner;
+    batch->sc_idx = sc_idx;
+    batch->push_block(block);
+    if (batch->count >= REMOTE_BATCH_BLOCKS)
+        remote_publish(batch);
+}
+
+void BaseMeta::remote_publish(RemoteBatch* batch) {
+    assert(batch->count > 0);
+    std::atomic<char*>& list = remote_slots[batch->owner - 1].lists[batch->sc_idx];
+    char* oldhead = list.load(std::memory_order_relaxed);
+    do {
+        *(pptr<char>*)batch->tail = oldhead;
+    } while (!list.compare_exchange_weak(oldhead, batch->head,
+                std::memory_order_release, std::memory_order_relaxed));
+    counters.remote_batches.fetch_add(1, std::memory_order_relaxed);
+    batch->head = nullptr;
+    batch->tail = nullptr;
+    batch->count = 0;
+}
+
+uint32_t BaseMeta::remote_adopt(size_t sc_idx, TCacheBin* cache, uint32_t want) {
+    std::atomic<char*>& list = remote_slots[t_caches.remote_slot - 1].lists[sc_idx];
+    if (list.load(std::memory_order_relaxed) == nullptr)
+        return 0;
+    char* head = list.exchange(nullptr, std::memory_order_acquire);
+    if (head == nullptr)
+        return 0;
+
+    // the list is nullptr terminated; take at most want blocks
+    char* tail = head;
+    uint32_t block_take = 1;
+    char* rest = static_cast<char*>(*(pptr<char>*)tail);
+    while (rest != nullptr && block_take < want) {
+        tail = rest;
+        block_take++;
+        rest = static_cast<char*>(*(pptr<char>*)tail);
+    }
+    if (rest != nullptr) {
+        // more than the cache can hold, give the rest back
+        uint32_t rest_count = 0;
+        for (char* b = rest; b != nullptr; b = static_cast<char*>(*(pptr<char>*)b))
+            rest_count++;
+        flush_list(sc_idx, rest, rest_count);
+    }
+    cache->push_list(head, tail, block_take);
+    counters.remote_adopted.fetch_add(block_take, std::memory_order_relaxed);
+    return block_take;
+}
+
+void BaseMeta::remote_drain(RemoteSlot* slot) {
+    for (size_t i = 1; i < MAX_SZ_IDX; i++) {// sc 0 is reserved.
+        if (slot->lists[i].load(std::memory_order_relaxed) == nullptr)
+            continue;
+        char* head = slot->lists[i].exchange(nullptr, std::memory_order_acquire);
+        uint32_t count = 0;
+        for (char* b = head; b != nullptr; b = static_cast<char*>(*(pptr<char>*)b))
+            count++;
+        if (count > 0)
+            flush_list(i, head, count);
+    }
+}
+
+void BaseMeta::remote_flush_batches(TCaches* tc) {
+    for (uint32_t i = 0; i < REMOTE_BATCHES; i++) {
+        RemoteBatch* batch = &tc->remote[i];
+        if (batch->count > 0) {
+            // the owner may be gone too, so give them back directly
+            flush_list(batch->sc_idx, batch->head, batch->count);
+            batch->count = 0;
+        }
+    }
+}
+
+void BaseMeta::remote_detach() {
+    remote_flush_batches(&t_caches);
+    if (t_caches.remote_slot != 0) {
+        // blocks freed to the slot after the drain stay there until the
+        //  slot is reused or the heap is closed
+        RemoteSlot* slot = &remote_slots[t_caches.remote_slot - 1];
+        remote_drain(slot);
+        t_caches.remote_slot = 0;
+        slot->in_use.store(false, std::memory_order_release);
+    }
+}
+
+void BaseMeta::remote_drain_orphans() {
+    for (uint32_t i = 0; i < REMOTE_SLOTS; i++) {
+        if (!remote_slots[i].in_use.load(std::memory_order_acquire))
+            remote_drain(&remote_slots[i]);
+    }
+}
+
+void BaseMeta::trim_cache(TCaches* tc, int level) {
+    for (size_t i = 1; i < MAX_SZ_IDX; i++) {// sc 0 is reserved.
+        TCacheBin* cache = &tc->t_cache[i];
+        uint32_t const min = get_sizeclass_by_idx(i)->cache_min_block_num;
+        uint32_t keep = 0;
+        if (level == TRIM_IDLE) {
+            cache->decay(min);
+            keep = cache->get_limit();
+        } else {
+            cache->shrink(min);
+            if (level == TRIM_MIN)
+                keep = cache->get_limit();
+        }
+        flush_cache(i, cache, keep);
+    }
+    if (level == TRIM_ALL) {
+        remote_flush_batches(tc);
+        // blocks other threads freed to us are only adopted by refills of
+        //  their classes, which may never come
+        if (tc->remote_slot != 0)
+            remote_drain(&remote_slots[tc->remote_slot - 1]);
+    }
+}
+
+void BaseMeta::trim_idle_caches() {
+    std::lock_guard<std::mutex> lk(tcaches_mtx);
+    // a thread still in TRIM_REQUESTED since the last round made no Ralloc
+    //  call in between, as enter() would have cancelled it
+    bool any = false;
+    for (TCaches* tc = tcaches_head; tc != nullptr; tc = tc->reg_next) {
+        tc->trim_candidate =
+            tc->trim_state.load(std::memory_order_relaxed) == TRIM_REQUESTED;
+        any |= tc->trim_candidate;
+    }
+    if (any) {
+        // after this, a candidate either has its busy store visible to us,
+        //  or will see TRIM_REQUESTED in its next enter()
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+    }
+    for (TCaches* tc = tcaches_head; tc != nullptr; tc = tc->reg_next) {
+        uint32_t state = TRIM_REQUESTED;
+        if (tc->trim_candidate) {
+            if (tc->busy.load(std::memory_order_acquire) != 0)
+                continue; // in a call, it will cancel the request
+            if (!tc->trim_state.compare_exchange_strong(state, TRIM_DRAINING))
+                continue; // cancelled
+            trim_cache(tc, TRIM_ALL);
+            counters.trimmer_drains.fetch_add(1, std::memory_order_relaxed);
+            tc->trim_state.store(TRIM_NONE, std::memory_order_release);
+        } else {
+            state = TRIM_NONE;
+            tc->trim_state.compare_exchange_strong(state, TRIM_REQUESTED);
+        }
+    }
+}
+
+namespace ralloc{
+    // background prefaulter
+    std::thread prefaulter;
+    std::mutex prefaulter_mtx;
+    std::condition_variable prefaulter_cv;
+    bool prefaulter_stop = false;
+    // where sb region is populated up to
+    std::atomic<char*> prefaulted(nullptr);
+}
+
+void ralloc::start_prefaulter(uint64_t distance){
+    prefault_distance = distance;
+    prefaulter_stop = false;
+    prefaulter = std::thread([distance]{
+        std::unique_lock<std::mutex> lk(prefaulter_mtx);
+        while (!prefaulter_stop) {
+            // populating may take long, don't hold up stop_prefaulter()
+            lk.unlock();
+            char* populated = base_md->prefault_ahead(prefaulted.load(), distance);
+            prefaulted.store(populated);
+            lk.lock();
+            if (!prefaulter_stop)
+                prefaulter_cv.wait_for(lk, milliseconds(PREFAULT_INTERVAL_MS));
+        }
+    });
+}
+
+void ralloc::stop_prefaulter(){
+    if (!prefaulter.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lk(prefaulter_mtx);
+        prefaulter_stop = true;
+    }
+    prefaulter_cv.notify_one();
+    prefaulter.join();
+    prefault_distance = 0;
+}
+
+void ralloc::prefault_kick(char* frontier){
+    // a wakeup lost without the lock is made up by the next interval
+    if (frontier + prefault_distance/2 > prefaulted.load(std::memory_order_relaxed))
+        prefaulter_cv.notify_one();
+}
+
+namespace ralloc{
+    // background trimmer
+    std::thread trimmer;
+    std::mutex trimmer_mtx;
+    std::condition_variable trimmer_cv;
+    bool trimmer_stop = false;
+    bool trimmer_running = false;
+}
+
+bool ralloc::start_trimmer(uint32_t interval_ms){
+    if (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) != 0) {
+        printf("Warning: membarrier isn't supported, trimmer is disabled\n");
+        return false;
+    }
+    trimmer_stop = false;
+    trimmer_running = true;
+    trimmer = std::thread([interval_ms]{
+        std::unique_lock<std::mutex> lk(trimmer_mtx);
+        while (!trimmer_stop) {
+            trimmer_cv.wait_for(lk, milliseconds(interval_ms));
+            if (!trimmer_stop)
+                base_md->trim_idle_caches();
+        }
+    });
+    return true;
+}
+
+void ralloc::stop_trimmer(){
+    if (!trimmer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lk(trimmer_mtx);
+        trimmer_stop = true;
+    }
+    trimmer_cv.notify_one();
+    trimmer.join();
+    trimmer_running = false;
+}
 
 // this can be called by TCaches
 void ralloc::public_flush_cache(){
     if(initialized) {
+        base_md->remote_detach();
         for(int i=1;i<MAX_SZ_IDX;i++){// sc 0 is reserved.
             base_md->flush_cache(i, &t_caches.t_cache[i]);
         }
@@ -742,7 +1460,13 @@ void GarbageCollection::operator() () {
     auto start = high_resolution_clock::now(); 
     // Step 0: initialize all transient data
     printf("Initializing all transient data...");
-    base_md->avail_sb.off.store(nullptr); // initialize avail_sb
+    sb_free_committed.store(0);
+    free_extents.clear();
+    base_md->saved_extents = nullptr;
+    for(uint32_t i = 0; i < MAX_SB_SHARDS; i++) {
+        // initialize free sb list of each shard
+        base_md->sb_shards[i].avail_sb.off.store(nullptr);
+    }
     for(int i = 0; i< MAX_SZ_IDX; i++) {
         // initialize partial list of each heap
         base_md->heaps[i].partial_list.off.store(nullptr);
@@ -771,27 +1495,50 @@ void GarbageCollection::operator() () {
     // Step 2: sweep phase, update variables.
     printf("Reconstructing metadata...");
     char* curr_sb = _rgs->translate(SB_IDX, reinterpret_cast<char*>(SBSIZE)); // starting from first sb
-    Descriptor* curr_desc = base_md->desc_lookup(curr_sb);
+    // walk descs of all sbs, including interior ones of spans
+    Descriptor* curr_desc = base_md->sb_desc_lookup(curr_sb);
     auto curr_marked_blk = marked_blk.begin();
     char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
-    Descriptor* avail_sb = nullptr; // head of new free sb list
+    // heads of new free sb lists, dealt to shards round robin
+    Descriptor* avail_sb[MAX_SB_SHARDS] = {};
+    uint32_t next_shard = 0;
+    // current run of empty sbs; a lone one goes to shards, and longer ones
+    // become free extents
+    char* run_start = nullptr;
+    uint64_t run_sbs = 0;
+    auto end_run = [&](){
+        if(run_sbs == 1) {
+            Descriptor* desc = base_md->sb_desc_lookup(run_start);
+            desc->next_free.store(avail_sb[next_shard]);
+            avail_sb[next_shard] = desc;
+            next_shard = (next_shard + 1) % ralloc::sb_shard_num;
+        } else if(run_sbs > 1) {
+            free_extents.insert(run_start, run_sbs*SBSIZE);
+        }
+        run_start = nullptr;
+        run_sbs = 0;
+    };
 
     // go through all sb in the region
     while(curr_sb < sb_end) {
         Anchor anchor(0, 0, SB_EMPTY);
         char* free_blocks_head = nullptr;
         char* last_possible_free_block = curr_sb;
-
-        // go through all curr_marked_blk that's in this sb
-        while (curr_marked_blk!=marked_blk.end() && 
-                ((uint64_t)curr_sb>>SB_SHIFT) == ((uint64_t)(*curr_marked_blk)>>SB_SHIFT)) 
+        // blocks of a class with spans may be anywhere in the span
+        char* span_end = curr_sb + SBSIZE;
+        if(curr_desc->maxcount != 0 && curr_desc->superblock == curr_sb &&
+            curr_desc->sc_idx != 0 && curr_desc->sc_idx < MAX_SZ_IDX)
+            span_end = curr_sb + base_md->get_sizeclass_by_idx(curr_desc->sc_idx)->sb_size;
+
+        // go through all curr_marked_blk that's in this sb or span
+        while (curr_marked_blk!=marked_blk.end() && (*curr_marked_blk) < span_end)
         { 
             // curr_marked_blk doesn't reach the end of marked_blk and curr_marked_blk is in curr_sb
 
-            if(curr_desc->heap != nullptr &&
+            if(curr_desc->maxcount != 0 &&
                 curr_desc->superblock == curr_sb) {
                 // false positive shouldn't enter here
-                if(curr_desc->heap->sc_idx == 0) {
+                if(curr_desc->sc_idx == 0) {
                     // large sb that's in use
                     // assert((*curr_marked_blk) == curr_sb); //allow large sb
                     // to be pointed at in the middle
@@ -814,14 +1561,19 @@ void GarbageCollection::operator() () {
             curr_marked_blk++;
         }
         if(anchor.state == SB_EMPTY) {
-            // curr_sb isn't in use
-            new (curr_desc) Descriptor();
-            curr_desc->next_free.store(avail_sb);
-            avail_sb = curr_desc;
+            // curr_sb isn't in use; it stays zero if it was, and an interior
+            // desc left by a span being retired is freed as well
+            // persisted by flushing desc region at the end
+            uint32_t flags = curr_desc->flags & DESC_ZEROED;
+            new (curr_desc) Descriptor(flags);
+            if(!flags) sb_free_committed++;
+            if(run_start == nullptr) run_start = curr_sb;
+            run_sbs++;
             curr_sb+=SBSIZE;
             curr_desc++;
         } else {
-            if(curr_desc->heap->sc_idx == 0) {
+            end_run();
+            if(curr_desc->sc_idx == 0) {
                 // large sb that's in use
 
                 anchor.avail = 0;
@@ -830,51 +1582,60 @@ void GarbageCollection::operator() () {
 
                 // set transient variables in curr_desc
                 curr_desc->next_free.store(nullptr);
+                curr_desc->flags = 0;
                 curr_desc->next_partial.store(nullptr);
                 curr_desc->anchor.store(anchor);
 
-                // move curr_sb to the sb next to this large sb
+                // move curr_sb to the sb next to this large sb, skipping
+                // marked blocks in its interior sbs
                 curr_sb+=curr_desc->block_size;
-                curr_desc = base_md->desc_lookup(curr_sb);
+                curr_desc = base_md->sb_desc_lookup(curr_sb);
+                while(curr_marked_blk!=marked_blk.end() && *curr_marked_blk < curr_sb)
+                    curr_marked_blk++;
             } else {
-                // small sb that's in use
-                for(char* free_block = last_possible_free_block; 
-                    free_block < curr_sb+curr_desc->maxcount*curr_desc->block_size; free_block+=curr_desc->block_size){
-                    // put last_possible_free_block...(curr_sb+SBSIZE-1) to free blk list
-                    (*reinterpret_cast<pptr<char>*>(free_block)) = free_blocks_head;
-                    free_blocks_head = free_block;
-                    anchor.count++;
-                }
-                if(anchor.count == 0) { 
+                // small sb that's in use; blocks after the last marked one
+                // are left beyond the frontier rather than linked
+                anchor.frontier = min((uint64_t)(last_possible_free_block - curr_sb)/curr_desc->block_size,
+                    (uint64_t)curr_desc->maxcount);
+                if(anchor.count == 0 && anchor.frontier == curr_desc->maxcount) { 
                     // this sb is fully used
                     anchor.avail = curr_desc->maxcount;
                     anchor.state = SB_FULL;
 
                     // set transient variables in curr_desc
                     curr_desc->next_free.store(nullptr);
+                    curr_desc->flags = 0;
                     curr_desc->next_partial.store(nullptr);
                     curr_desc->anchor.store(anchor);
                 } else {
                     // this sb is partially used
-                    assert(free_blocks_head != nullptr);
-                    assert((uint64_t)(free_blocks_head - curr_sb)%curr_desc->block_size == 0);
-                    anchor.avail = (uint64_t)(free_blocks_head - curr_sb)/curr_desc->block_size;
+                    if(free_blocks_head != nullptr) {
+                        assert((uint64_t)(free_blocks_head - curr_sb)%curr_desc->block_size == 0);
+                        anchor.avail = (uint64_t)(free_blocks_head - curr_sb)/curr_desc->block_size;
+                    } else {
+                        anchor.avail = curr_desc->maxcount;
+                    }
                     anchor.state = SB_PARTIAL; // it must be SB_PARTIAL already but we assign it anyway
 
                     // set transient variables in curr_desc
                     curr_desc->next_free.store(nullptr);
+                    curr_desc->flags = 0;
                     base_md->heap_push_partial(curr_desc);
                     curr_desc->anchor.store(anchor);
                 }
-                // move curr_sb and curr_desc to next sb
-                curr_sb+=SBSIZE;
-                curr_desc++;
+                // move curr_sb and curr_desc to next sb or span; interior
+                // descs of the span are kept as they are
+                curr_sb = span_end;
+                curr_desc = base_md->sb_desc_lookup(curr_sb);
             }
         }
     }
-    // store head of new free sb list into base_md
-    ptr_cnt<Descriptor> tmp_avail_sb(avail_sb, 0);
-    base_md->avail_sb.store(tmp_avail_sb);
+    end_run();
+    // store heads of new free sb lists into base_md
+    for(uint32_t i = 0; i < ralloc::sb_shard_num; i++) {
+        ptr_cnt<Descriptor> tmp_avail_sb(avail_sb[i], 0);
+        base_md->sb_shards[i].avail_sb.store(tmp_avail_sb);
+    }
     printf("Reconstructed! \n");
     auto stop = high_resolution_clock::now(); 
     assert(curr_marked_blk == marked_blk.end());
@@ -883,14 +1644,12 @@ void GarbageCollection::operator() () {
 
 
     printf("Flushing recovered data...");
-    _rgs->flush_region(DESC_IDX);
-    _rgs->flush_region(SB_IDX);
-    char* addr_to_flush = reinterpret_cast<char*>(base_md);
-    // flush values in BaseMeta, including avail_sb and partial lists
-    for(size_t i = 0; i < sizeof(BaseMeta); i += CACHELINE_SIZE) {
-        addr_to_flush += CACHELINE_SIZE;
-        FLUSH(addr_to_flush);
-    }
+    // only sbs in use hold data; flushing the rest would fault punched ones
+    // back in
+    base_md->mark_used_sbs();
+    base_md->flush_heap(ralloc::writeback_thread_num);
+    // flush values in BaseMeta, including sb_shards and partial lists
+    pwb_range(base_md, reinterpret_cast<char*>(base_md) + sizeof(BaseMeta));
     FLUSHFENCE;
     printf("Garbage collection Completed!\n");
 }
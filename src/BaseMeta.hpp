@@ -26,6 +26,8 @@
 #include "pm_config.hpp"
 
 #include "RegionManager.hpp"
+#include "ExtentMap.hpp"
+#include "DirtyMap.hpp"
 #include "SizeClass.hpp"
 #include "TCache.hpp"
 #include "pptr.hpp"
@@ -76,6 +78,121 @@ namespace ralloc{
     // function to flush thread-local cache, used in TCaches::~TCaches and
     // BaseMeta::writeback()
     extern void public_flush_cache();
+
+    /*
+     * struct Counters
+     *
+     * Description:
+     *  Transient event counters of the slow paths, summed over all threads
+     *  and reported by RP_get_stats().
+     */
+    struct Counters{
+        // thread cache refills
+        std::atomic<uint64_t> cache_fills;
+        // flushes draining a whole bin, and those keeping its hot blocks
+        std::atomic<uint64_t> cache_full_flushes;
+        std::atomic<uint64_t> cache_partial_flushes;
+        // remote free batches handed over, and blocks adopted from them
+        std::atomic<uint64_t> remote_batches;
+        std::atomic<uint64_t> remote_adopted;
+        // caches of idle threads drained by trimmer
+        std::atomic<uint64_t> trimmer_drains;
+        // free superblocks taken from a shard other than the local one
+        std::atomic<uint64_t> sb_steals;
+        // empty superblocks punched out of the heap file
+        std::atomic<uint64_t> sb_decommits;
+        // bytes of sb and desc regions populated ahead of the frontier
+        std::atomic<uint64_t> prefault_bytes;
+        // fences and flushes no longer issued by the paths batched by
+        // PersistBatch or left to their callers, over the code they replace
+        std::atomic<uint64_t> fences_saved;
+        std::atomic<uint64_t> flushes_saved;
+        Counters() noexcept: cache_fills(0), cache_full_flushes(0),
+            cache_partial_flushes(0), remote_batches(0), remote_adopted(0),
+            trimmer_drains(0), sb_steals(0), sb_decommits(0),
+            prefault_bytes(0), fences_saved(0), flushes_saved(0){};
+    };
+    extern Counters counters;
+    // empty superblocks kept committed before punching; 0 never punches
+    extern uint32_t sb_decommit_watermark;
+    // empty superblocks whose memory is committed; approximate, as it's
+    // updated apart from the free lists
+    extern std::atomic<int64_t> sb_free_committed;
+    // free runs of superblocks for large blocks
+    extern ExtentMap free_extents;
+    // superblocks to write back at exit, indexed from the start of sb region
+    extern DirtyMap sb_dirty;
+    // threads writing back the heap, at exit and after GC
+    extern uint32_t writeback_thread_num;
+    // number of shards of the free superblock list in use, 1..MAX_SB_SHARDS
+    extern uint32_t sb_shard_num;
+    // last size served by size classes, MAX_SMALL_SZ..MAX_SZ
+    extern uint32_t sc_max_size;
+    // bytes beyond the frontier of sb region kept populated, 0 if there's no
+    // prefaulter
+    extern uint64_t prefault_distance;
+    // start the background trimmer visiting thread caches every interval_ms;
+    // return false if membarrier isn't supported
+    bool start_trimmer(uint32_t interval_ms);
+    // stop the background trimmer if it's running
+    void stop_trimmer();
+    // start the background prefaulter keeping distance bytes of sb region
+    // beyond its frontier, and their descs, populated
+    void start_prefaulter(uint64_t distance);
+    // stop the background prefaulter if it's running
+    void stop_prefaulter();
+    // wake the prefaulter up if the frontier gets close to what's populated
+    void prefault_kick(char* frontier);
+};
+
+/*
+ * class PersistBatch
+ *
+ * Description:
+ *  Cache lines a logical operation has to write back, flushed once each and
+ *  fenced once at the durability point of the operation, rather than by a
+ *  FLUSH and FLUSHFENCE per field. A line added again is only flushed once.
+ *  Lines beyond BATCH_LINES are flushed right away without dedup, which is
+ *  fine as only the fence orders flushes.
+ *
+ * Usage:
+ *  add(addr): write back the line of addr at commit().
+ *  add_range(start, end): write back all lines in [start, end), at once.
+ *  commit(flushes, fences): flush pending lines and fence; the batch is
+ *   empty afterwards. flushes and fences are what the code the batch
+ *   replaces issued; what the batch issued less goes to ralloc::counters.
+ */
+class PersistBatch {
+    static const uint32_t BATCH_LINES = 16;
+    uint64_t lines[BATCH_LINES];
+    uint32_t num = 0;
+    // lines flushed since last commit
+    uint64_t flushed = 0;
+
+    inline void drain(){
+        for(uint32_t i = 0; i < num; i++)
+            FLUSH(reinterpret_cast<char*>(lines[i]));
+        flushed += num;
+        num = 0;
+    }
+public:
+    inline void add(const void* addr){
+        uint64_t line = reinterpret_cast<uint64_t>(addr) & ~CACHELINE_MASK;
+        for(uint32_t i = 0; i < num; i++)
+            if(lines[i] == line) return;
+        if(num == BATCH_LINES) drain();
+        lines[num++] = line;
+    }
+    inline void add_range(const void* start, const void* end){
+        uint64_t first = reinterpret_cast<uint64_t>(start) & ~CACHELINE_MASK;
+        uint64_t n = (reinterpret_cast<uint64_t>(end) - first + CACHELINE_MASK)/CACHELINE_SIZE;
+        pwb_range(start, end);
+        flushed += n;
+    }
+    void commit(uint64_t flushes = 0, uint64_t fences = 0);
+    ~PersistBatch(){
+        assert(num == 0 && "PersistBatch isn't committed!");
+    }
 };
 
 /* 
@@ -113,6 +230,12 @@ public:
     }
     template<class F>
     inline CrossPtr& operator= (const F* p){
+        if(UNLIKELY(p == nullptr)){
+            // as in the constructor; untranslating it would give an offset
+            // valid only while the region stays where it is
+            off = nullptr;
+            return *this;
+        }
         uint64_t tmp = reinterpret_cast<uint64_t>(p);//get rid of const
         off = ralloc::_rgs->untranslate(idx, reinterpret_cast<char*>(tmp));
         return *this;
@@ -226,14 +349,29 @@ struct ProcHeap;
  * 
  * Description:
  *  64-bit anchor in each descriptor, descripting status of a superblock.
+ *  Free blocks of a superblock are count blocks in the list from avail,
+ *  plus those from frontier up to maxcount, which are never carved out of
+ *  the superblock since it was taken, so nothing is written to them.
  */
 struct Anchor{
-    uint64_t avail:31,count:31, state:2;
+    uint64_t avail:21,count:21,frontier:20,state:2;
     Anchor(uint64_t a = 0) noexcept {(*(uint64_t*)this) = a;}
-    Anchor(unsigned a, unsigned c, unsigned s) noexcept :
-        avail(a),count(c),state(s){};
+    Anchor(unsigned a, unsigned c, unsigned s, unsigned f = 0) noexcept :
+        avail(a),count(c),frontier(f),state(s){};
 };
 static_assert(sizeof(Anchor) == sizeof(uint64_t), "Invalid anchor size");
+// frontier may be maxcount of the smallest class
+static_assert(SBSIZE/8 < (1 << 20), "Anchor::frontier is too narrow");
+
+// Descriptor::flags
+enum DescriptorFlag : uint32_t {
+    // the free sb has never been touched or was punched out, so it reads as
+    // zero and takes no space in the heap file
+    DESC_ZEROED = 1,
+    // the sb is in a span of a size class but not its first, and
+    // superblock points to the first one whose desc describes the span
+    DESC_INTERIOR = 2,
+};
 
 /* 
  * struct Descriptor
@@ -251,20 +389,31 @@ struct Descriptor {
     RP_TRANSIENT std::atomic<Anchor> anchor;
 
     RP_PERSIST CrossPtr<char, SB_IDX> superblock;
-    RP_PERSIST CrossPtr<ProcHeap, META_IDX> heap;
     RP_PERSIST uint32_t block_size; // block size acquired from sc
-    RP_PERSIST uint32_t maxcount; // block number acquired from sc
-    Descriptor() noexcept :
+    RP_PERSIST uint32_t maxcount; // block number acquired from sc; 0 if unused
+    // size class index, 0 for large sb; heap of this sb is heaps[sc_idx]
+    RP_PERSIST uint32_t sc_idx;
+    // remote slot of the thread last filled its cache from this sb, 0 if none
+    RP_TRANSIENT std::atomic<uint32_t> owner;
+    // DescriptorFlag; DESC_ZEROED of a free sb is cleared when the sb is
+    // reused, and DESC_INTERIOR when the span is retired
+    RP_PERSIST uint32_t flags;
+    Descriptor() noexcept : Descriptor(0){
+            FLUSH(this);
+            FLUSHFENCE;
+        };
+    // with flags f, and not persisted; for many descs at once, which had
+    // better be flushed by pwb_range() and one fence
+    explicit Descriptor(uint32_t f) noexcept :
         next_free(),
         next_partial(),
         anchor(),
         superblock(),
-        heap(),
         block_size(),
-        maxcount(){
-            FLUSH(this);
-            FLUSHFENCE;
-        };
+        maxcount(),
+        sc_idx(),
+        owner(0),
+        flags(f){};
 }__attribute__((aligned(CACHELINE_SIZE)));
 static_assert(sizeof(Descriptor) == CACHELINE_SIZE, "Invalid Descriptor size");
 
@@ -289,6 +438,22 @@ public:
         partial_list(){};
 }__attribute__((aligned(CACHELINE_SIZE)));
 
+/*
+ * struct SbShard
+ *
+ * Description:
+ *  One shard of the free superblock list. A thread pushes superblocks to and
+ *  pops them from the shard of the CPU it runs on, and steals from other
+ *  shards only when that one is empty.
+ */
+struct SbShard {
+public:
+    // ptr to descriptor, head of free superblock list
+    RP_TRANSIENT AtomicCrossPtrCnt<Descriptor, DESC_IDX> avail_sb;
+    SbShard() noexcept :
+        avail_sb(){};
+}__attribute__((aligned(CACHELINE_SIZE)));
+
 /* 
  * class GarbageCollection
  * 
@@ -336,28 +501,40 @@ namespace ralloc{
     extern std::function<void(const CrossPtr<char, SB_IDX>&, GarbageCollection&)> roots_filter_func[MAX_ROOTS];
 }
 
+// "RALLOC" and version of the persistent layout of BaseMeta and Descriptor;
+// bump the version on any change to it, so that heaps of other versions are
+// refused rather than misread
+const uint64_t BASEMETA_LAYOUT = 0x52414c4c4f430000ULL | 1;
+
 /*
  * class BaseMeta
  * 
  * Description:
  *  The core data structure in this file.
  *  Contains essential metadata for Ralloc, including:
- *      avail_sb: superblock free list 
+ *      layout: BASEMETA_LAYOUT of the heap, checked on restart
+ *      sb_shards: superblock free lists, one per CPU
  *      dirty_attr, dirty_mtx: dirty flag
  *      heaps: sizeclasses and their partial lists
  *      roots: pointers to persistent roots
+ *      saved_extents: free extents saved by writeback() for restart
  *  do_malloc() and do_free() are the real entry point of Ralloc's malloc and
  *  free routines.
  */
 class BaseMeta {
 public:
-    // unused small sb
-    RP_TRANSIENT AtomicCrossPtrCnt<Descriptor, DESC_IDX> avail_sb;
+    // BASEMETA_LAYOUT the heap was created with; must stay the first field
+    RP_PERSIST uint64_t layout;
+    // unused small sb; ralloc::sb_shard_num of them are used
+    RP_TRANSIENT SbShard sb_shards[MAX_SB_SHARDS];
     RP_PERSIST pthread_mutexattr_t dirty_attr;
     RP_PERSIST pthread_mutex_t dirty_mtx;
 
     RP_PERSIST ProcHeap heaps[MAX_SZ_IDX];
     RP_PERSIST CrossPtr<char, SB_IDX> roots[MAX_ROOTS];
+    // descriptors of heads of free extents linked by next_free, with length
+    // in sbs in block_size; only valid after a clean exit
+    RP_PERSIST CrossPtr<Descriptor, DESC_IDX> saved_extents;
     friend class GarbageCollection;
     BaseMeta() noexcept;
     ~BaseMeta(){
@@ -366,8 +543,11 @@ public:
          */
         std::cout<<"Warning: BaseMeta is being destructed!\n";
     }
-    void* do_malloc(size_t size);
+    // *zeroed, if given, is set when a large block is known to read zero
+    void* do_malloc(size_t size, bool* zeroed = nullptr);
     void do_free(void* ptr);
+    // free ptr allocated with size, without looking up its descriptor
+    void do_free_sized(void* ptr, size_t size);
     bool is_dirty();
     // set_dirty must be called AFTER is_dirty
     void set_dirty();
@@ -420,12 +600,9 @@ public:
         // Give back tcached blocks *Wentao: no actually ~TCache will do this*
         // Should be called during normal exit
         // ralloc::public_flush_cache();
-        char* addr = reinterpret_cast<char*>(this);
-        // flush values in BaseMeta, including avail_sb and partial lists
-        for(size_t i = 0; i < sizeof(BaseMeta); i += CACHELINE_SIZE) {
-            addr += CACHELINE_SIZE;
-            FLUSH(addr);
-        }
+        save_extents();
+        // flush values in BaseMeta, including sb_shards and partial lists
+        pwb_range(this, reinterpret_cast<char*>(this) + sizeof(BaseMeta));
         FLUSHFENCE;
         set_clean();
     }
@@ -434,7 +611,9 @@ private:
     // void* expand_sb(size_t sz);
     // void expand_small_sb();
     // void* expand_get_small_sb();
-    void* expand_get_large_sb(size_t sz);
+    // take sz bytes of never used sbs from the frontier of sb region, i.e.,
+    // its persistent curr_addr
+    void* expand_get_sb(size_t sz);
 
     // func on size class
     size_t get_sizeclass(size_t size);
@@ -442,15 +621,88 @@ private:
     SizeClassData* get_sizeclass_by_idx(size_t idx);
     // compute block index in superblock by addr to sb, block, and sc index
     uint32_t compute_idx(char* superblock, char* block, size_t sc_idx);
+    // link num blocks of superblock from index first into a list; return
+    // the last one
+    char* carve(char* superblock, uint32_t block_size, uint32_t first, uint32_t num);
 
     // func on cache
     void fill_cache(size_t sc_idx, TCacheBin* cache);
+    // handle a free into a bin that reached its capacity
+    void cache_overflow(size_t sc_idx, TCacheBin* cache);
+    // count a slow path event and decay an idle bin if it's time to
+    void cache_tick();
+    // give a list of block_count blocks back to the superblock of desc;
+    // tail may be nullptr, in which case it's looked up only if needed
+    void give_back(size_t sc_idx, Descriptor* desc, char* head, char* tail, uint32_t block_count);
+
+    // func on remote free
+    // get a free remote slot for this thread, if there's any
+    void remote_attach();
+    // batch a free of block owned by remote slot owner
+    void remote_free_block(size_t sc_idx, uint32_t owner, char* block);
+    // hand a batch over to its owner
+    void remote_publish(RemoteBatch* batch);
+    // move at most want blocks freed to our slot into cache, return the number
+    uint32_t remote_adopt(size_t sc_idx, TCacheBin* cache, uint32_t want);
+    // give all blocks in slot back to their superblocks
+    void remote_drain(RemoteSlot* slot);
 public:
+    // flush pending remote frees of this thread and release its slot,
+    // called with flush of TLS cache during exit
+    void remote_detach();
+    // give back pending remote frees in tc to their superblocks
+    void remote_flush_batches(TCaches* tc);
+    // move free sbs in shards beyond ralloc::sb_shard_num, left by a run with
+    // more shards, into shards in use, and count committed ones among all
+    // free sbs; called on restart
+    void fold_sb_shards();
+    // logical size of sb region in use, and how much of it is resident
+    void sb_usage(uint64_t* logical, uint64_t* resident);
+    // populate sb region from what's populated up to distance bytes beyond
+    // its frontier, and the descs of those sbs; return where it's populated
+    // up to
+    char* prefault_ahead(char* populated, uint64_t distance);
+    // extend desc region to hold the descs of all sbs before sb_end, as sb
+    // region may have grown past it
+    void extend_descs(char* sb_end);
+    // save free extents to saved_extents, and load them back on restart
+    void save_extents();
+    void load_extents();
+    // mark sbs in use as dirty, as their blocks may be written from now on;
+    // called on restart
+    void mark_used_sbs();
+    // write back desc region and dirty sbs by thread_num threads, and return
+    // the bytes written back; called at exit
+    uint64_t flush_heap(uint32_t thread_num);
+    // trim thread cache tc by TrimLevel level; tc must be of the caller or
+    // owned by trimmer in TRIM_DRAINING
+    void trim_cache(TCaches* tc, int level);
+    // one round of the background trimmer
+    void trim_idle_caches();
+    // give back blocks left in slots nobody owns
+    void remote_drain_orphans();
     // we need to call this function to flush TLS cache during exit
-    void flush_cache(size_t sc_idx, TCacheBin* cache);
+    // only the first keep blocks (the most recently freed) stay in cache
+    void flush_cache(size_t sc_idx, TCacheBin* cache, uint32_t keep = 0);
+    // give a list of block_count blocks back to their superblocks
+    void flush_list(size_t sc_idx, char* head, uint32_t block_count);
+    // find desc of the sb ptr is in, even if it's interior to a span
+    inline Descriptor* sb_desc_lookup(const char* ptr){
+        // the index of sb this block in
+        uint64_t sb_index = (((uint64_t)ptr)>>SB_SHIFT) - (((uint64_t)ralloc::_rgs->lookup(SB_IDX))>>SB_SHIFT);
+        Descriptor* ret = reinterpret_cast<Descriptor*>(ralloc::_rgs->lookup(DESC_IDX));
+        ret+=sb_index;
+        return ret;
+    }
     // find desc of the block
-    // we need to call them in GC
-    Descriptor* desc_lookup(const char* ptr);
+    // we need to call them in GC, and in the inline fast path of free
+    inline Descriptor* desc_lookup(const char* ptr){
+        Descriptor* ret = sb_desc_lookup(ptr);
+        // blocks of classes with spans may be in interior sbs
+        if(UNLIKELY(ret->flags & DESC_INTERIOR))
+            ret = sb_desc_lookup(static_cast<char*>(ret->superblock));
+        return ret;
+    }
     inline Descriptor* desc_lookup(const void* ptr){return desc_lookup(reinterpret_cast<const char*>(ptr));}
     char* sb_lookup(Descriptor* desc);
 
@@ -458,22 +710,43 @@ private:
     // helper func
     void heap_push_partial(Descriptor* desc);
     Descriptor* heap_pop_partial(ProcHeap* heap);
-    // fill cache from a partially used sb in heap[sc_idx]
-    void malloc_from_partial(size_t sc_idx, TCacheBin* cache, size_t& block_num);
-    // fill cache by allocating a new sb in heap[sc_idx]
-    void malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_num);
+    // fill cache with at most want blocks from a partially used sb in heap[sc_idx]
+    void malloc_from_partial(size_t sc_idx, TCacheBin* cache, size_t& block_num, uint32_t want);
+    // fill cache with at most want blocks by allocating a new sb in heap[sc_idx]
+    void malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_num, uint32_t want);
     // alloc function to call for large block
-    void* alloc_large_block(size_t sz);
+    void* alloc_large_block(size_t sz, bool* zeroed);
 
-    // add all newly allocated sbs to free_sb
-    void organize_sb_list(void* start, uint64_t count);
+    // shard of free sb list of the CPU the caller runs on
+    uint32_t local_sb_shard();
+    // mark size bytes of sbs from sb as dirty before handing blocks out
+    inline void mark_dirty(char* sb, uint64_t size){
+        ralloc::sb_dirty.mark((sb - ralloc::_rgs->lookup(SB_IDX))/SBSIZE, size/SBSIZE);
+    }
+    // push descriptors first...last linked by next_free to shard
+    void sb_push(uint32_t shard, Descriptor* first, Descriptor* last);
+    // pop a free sb from shard, or return nullptr if it's empty
+    Descriptor* sb_pop(uint32_t shard);
+    // account count empty sbs from sb being retired, and punch them out if
+    // that exceeds the watermark; return true if they are punched
+    bool sb_decommit(void* sb, uint64_t count);
+    // account count free sbs from first being taken into use, clearing their
+    // DESC_ZEROED; return true if all of them had it
+    bool take_sbs(Descriptor* first, uint64_t count);
+    // push count sbs of a free extent from start to the local shard
+    void extent_to_shard(char* start, uint64_t count);
     // get one free sb or allocate a new space for sbs
     void* small_sb_alloc(size_t size);
     // free the superblock sb points to
     void small_sb_retire(void* sb, size_t size);
-
-    // allocate a large sb
-    void* large_sb_alloc(size_t size);
+    // get a span of sbs for a size class, marking interior descs
+    void* span_alloc(size_t size);
+    // superblock of a size class of sb_size: a sb or a span of them
+    void* sc_sb_alloc(size_t sb_size);
+    void sc_sb_retire(void* sb, size_t sb_size);
+
+    // allocate a large sb; *zeroed, if given, tells if all of it reads zero
+    void* large_sb_alloc(size_t size, bool* zeroed = nullptr);
     // retire a large sb
     void large_sb_retire(void* sb, size_t size);
 
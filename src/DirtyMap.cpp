@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#include "DirtyMap.hpp"
+
+#include <assert.h>
+#include <sys/mman.h>
+
+void DirtyMap::init(uint64_t count){
+    assert(words == nullptr);
+    word_num = (count + 63)/64;
+    void* addr = mmap(nullptr, word_num*sizeof(uint64_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(addr != MAP_FAILED && "dirty map fails!");
+    words = reinterpret_cast<std::atomic<uint64_t>*>(addr);
+}
+
+DirtyMap::~DirtyMap(){
+    if(words != nullptr)
+        munmap(words, word_num*sizeof(uint64_t));
+}
+
+void DirtyMap::clear(uint64_t idx, uint64_t count){
+    for(uint64_t end = idx + count; idx < end;){
+        uint64_t n = std::min(end, (idx/64 + 1)*64) - idx;
+        words[idx/64].fetch_and(~bits(idx%64, n), std::memory_order_relaxed);
+        idx += n;
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#ifndef _DIRTY_MAP_HPP_
+#define _DIRTY_MAP_HPP_
+
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+
+/*
+ * class DirtyMap
+ *
+ * Description:
+ *  Transient bitmap of superblocks that may hold data not written back yet,
+ *  one bit per superblock. Blocks are only written while they are allocated,
+ *  so a superblock is marked when its blocks are handed out, or at restart if
+ *  it's in use, and cleared when it's punched out of the heap file. Writeback
+ *  at exit skips superblocks left clear.
+ *
+ *  Bits are in an anonymous mapping reserved for the whole sb region, so only
+ *  pages of bits ever marked take memory. Marking reads the bits first and
+ *  writes only if any is clear, so superblocks in use don't bounce the line.
+ *
+ * Usage:
+ *  init(count): map bits of count superblocks, all clear.
+ *  mark(idx, count): mark superblocks idx..idx+count-1.
+ *  clear(idx, count): clear them.
+ *  word(i): bits of superblocks 64*i..64*i+63.
+ */
+class DirtyMap {
+    std::atomic<uint64_t>* words;
+    uint64_t word_num;
+
+    // bits first..first+count-1 of a word; count is 1..64
+    static inline uint64_t bits(uint64_t first, uint64_t count){
+        return (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << first;
+    }
+public:
+    DirtyMap() noexcept : words(nullptr), word_num(0){};
+    ~DirtyMap();
+    void init(uint64_t count);
+    inline void mark(uint64_t idx, uint64_t count = 1){
+        for(uint64_t end = idx + count; idx < end;){
+            uint64_t n = std::min(end, (idx/64 + 1)*64) - idx;
+            uint64_t b = bits(idx%64, n);
+            std::atomic<uint64_t>& w = words[idx/64];
+            if((w.load(std::memory_order_relaxed) & b) != b)
+                w.fetch_or(b, std::memory_order_relaxed);
+            idx += n;
+        }
+    }
+    void clear(uint64_t idx, uint64_t count);
+    inline uint64_t word(uint64_t i) const{
+        return words[i].load(std::memory_order_relaxed);
+    }
+};
+
+#endif /* _DIRTY_MAP_HPP_ */
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#include "ExtentMap.hpp"
+
+void ExtentMap::add(char* start, uint64_t len){
+    by_addr.emplace(start, len);
+    by_len.emplace(len, start);
+}
+
+void ExtentMap::remove(std::map<char*, uint64_t>::iterator it){
+    by_len.erase(std::make_pair(it->second, it->first));
+    by_addr.erase(it);
+}
+
+void ExtentMap::insert(char* start, uint64_t len){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto next = by_addr.lower_bound(start);
+    if(next != by_addr.begin()){
+        auto prev = std::prev(next);
+        if(prev->first + prev->second == start){
+            // merge with the extent right before
+            start = prev->first;
+            len += prev->second;
+            remove(prev);
+        }
+    }
+    if(next != by_addr.end() && start + len == next->first){
+        // merge with the extent right after
+        len += next->second;
+        remove(next);
+    }
+    add(start, len);
+}
+
+char* ExtentMap::take(uint64_t len){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto fit = by_len.lower_bound(std::make_pair(len, (char*)nullptr));
+    if(fit == by_len.end())
+        return nullptr;
+    char* start = fit->second;
+    uint64_t fit_len = fit->first;
+    remove(by_addr.find(start));
+    if(fit_len > len)
+        add(start + len, fit_len - len);
+    return start;
+}
+
+char* ExtentMap::take_smallest(uint64_t max_len, uint64_t* len){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(by_len.empty())
+        return nullptr;
+    char* start = by_len.begin()->second;
+    uint64_t fit_len = by_len.begin()->first;
+    remove(by_addr.find(start));
+    *len = fit_len < max_len ? fit_len : max_len;
+    if(fit_len > *len)
+        add(start + *len, fit_len - *len);
+    return start;
+}
+
+void ExtentMap::clear(){
+    std::lock_guard<std::mutex> lk(mtx);
+    by_addr.clear();
+    by_len.clear();
+}
+
+uint64_t ExtentMap::total(){
+    std::lock_guard<std::mutex> lk(mtx);
+    uint64_t ret = 0;
+    for(auto& e : by_addr)
+        ret += e.second;
+    return ret;
+}
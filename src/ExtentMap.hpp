@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#ifndef _EXTENT_MAP_HPP_
+#define _EXTENT_MAP_HPP_
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <mutex>
+#include <utility>
+
+/*
+ * class ExtentMap
+ *
+ * Description:
+ *  Transient index of free extents, i.e., runs of contiguous free
+ *  superblocks, for large allocations. Extents are indexed both by address,
+ *  to coalesce a freed extent with its neighbours, and by length, to take
+ *  the best fit. All operations hold one mutex; they are only on the paths
+ *  of large blocks and of refilling empty superblock shards, which are rare
+ *  and cost far more than the lock anyway.
+ *
+ *  It's rebuilt by GC after a dirty restart, and is saved into descriptors
+ *  by BaseMeta::writeback() for a clean one.
+ *
+ * Usage:
+ *  insert(start, len): add free extent [start, start+len), merging it with
+ *      the extents right before and after it.
+ *  take(len): remove the smallest extent of at least len bytes, put back
+ *      what's beyond len, and return its start; nullptr if there's none.
+ *  take_smallest(max_len, len): remove up to max_len bytes from the front
+ *      of the smallest extent; return its start and write the length taken
+ *      to len, or nullptr if the map is empty.
+ *  clear(): drop all extents.
+ *  for_each(f): call f(start, len) on each extent, in address order.
+ */
+class ExtentMap {
+    std::mutex mtx;
+    // start -> length in bytes
+    std::map<char*, uint64_t> by_addr;
+    // (length, start)
+    std::set<std::pair<uint64_t, char*>> by_len;
+
+    void add(char* start, uint64_t len);
+    void remove(std::map<char*, uint64_t>::iterator it);
+public:
+    void insert(char* start, uint64_t len);
+    char* take(uint64_t len);
+    char* take_smallest(uint64_t max_len, uint64_t* len);
+    void clear();
+    template<class F>
+    void for_each(F f){
+        std::lock_guard<std::mutex> lk(mtx);
+        for(auto& e : by_addr)
+            f(e.first, e.second);
+    }
+    // total bytes in free extents
+    uint64_t total();
+};
+
+#endif /* _EXTENT_MAP_HPP_ */
@@ -32,6 +32,7 @@
 #include <sys/select.h>
 
 #include <iostream>
+#include <algorithm>
 // //mmap anynomous
 // void RegionManager::__map_transient_region(){
 // 	char* ret = (char*) mmap((void*) 0, FILESIZE,
@@ -49,6 +50,92 @@
 // 	printf("Current_addr: %p\n", curr_addr);
 // }
 
+void RegionManager::__reserve_region(){
+    // reserve REGION_ALIGN more to align base_addr, and give back the slack
+    uint64_t len = RESERVESIZE + REGION_ALIGN;
+    char* addr = (char*) mmap(0, len, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(addr != MAP_FAILED);
+    char* aligned = ALIGN_ADDR(addr, REGION_ALIGN);
+    if(aligned != addr)
+        munmap(addr, aligned - addr);
+    if(aligned + RESERVESIZE != addr + len)
+        munmap(aligned + RESERVESIZE, addr + len - (aligned + RESERVESIZE));
+    base_addr = aligned;
+}
+
+void RegionManager::__map_file(uint64_t from, uint64_t to){
+    int flags = persist ? MMAP_FLAG : (MAP_SHARED | MAP_NORESERVE);
+    void * addr =
+        mmap(base_addr + from, to - from, PROT_READ | PROT_WRITE,
+            flags | MAP_FIXED, FD, from);
+    assert(addr == base_addr + from);
+    // needed for THP on tmpfs unless it's enabled for all; fsdax gets PMD
+    // mappings by alignment alone
+    madvise(addr, to - from, MADV_HUGEPAGE);
+}
+
+uint64_t RegionManager::__page_size(){
+    // fault in the first huge page of the region, so that smaps tells what
+    // it's mapped by rather than what it may be; its pages are written
+    // without changing them, as the header is there
+    uint64_t len = std::min((uint64_t)HUGEPAGE_SIZE, FILESIZE.load());
+    if(madvise(base_addr, len, MADV_POPULATE_WRITE) != 0){
+        // unsupported before Linux 5.14
+        for(char* p = base_addr; p < base_addr + len; p += PAGESIZE)
+            __atomic_fetch_add(reinterpret_cast<uint64_t*>(p), 0, __ATOMIC_RELAXED);
+    }
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if(f == nullptr)
+        return PAGESIZE;
+    uint64_t page = PAGESIZE;
+    bool huge = false;
+    bool found = false;
+    char line[256];
+    while(fgets(line, sizeof(line), f) != nullptr){
+        uint64_t start, end, kb;
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2){
+            // attributes of a vma follow its range
+            if(found)
+                break;
+            found = start <= (uint64_t)base_addr && (uint64_t)base_addr < end;
+        } else if(!found){
+            continue;
+        } else if(sscanf(line, "KernelPageSize: %lu kB", &kb) == 1){
+            page = kb*1024;
+        } else if(sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+            sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 ||
+            sscanf(line, "AnonHugePages: %lu kB", &kb) == 1){
+            // PMD mappings of whichever kind the region has
+            huge |= kb != 0;
+        }
+    }
+    fclose(f);
+    return huge ? HUGEPAGE_SIZE : page;
+}
+
+bool RegionManager::__grow_region(uint64_t size){
+    std::lock_guard<std::mutex> lk(grow_lock);
+    uint64_t old_size = FILESIZE.load();
+    if(size <= old_size)
+        return true; // grown by someone else meanwhile
+    if(size > RESERVESIZE)
+        return false;
+    // at least double the file so that growth stays rare
+    uint64_t new_size = std::min(std::max((uint64_t)PAGE_CEILING(size), 2*old_size), RESERVESIZE);
+    if(ftruncate(FD, new_size) != 0)
+        return false;
+    __map_file(old_size, new_size);
+    // the file grows first, so size in the first page never exceeds it
+    uint64_t* size_ptr = (uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>));
+    *size_ptr = new_size;
+    FLUSH(size_ptr);
+    FLUSHFENCE;
+    FILESIZE.store(new_size);
+    DBG_PRINT("Region %s grows from %lu to %lu bytes\n", HEAPFILE.c_str(), old_size, new_size);
+    return true;
+}
+
 //mmap file
 void RegionManager::__map_persistent_region(){
     DBG_PRINT("Creating a new persistent region...\n");
@@ -63,22 +150,19 @@ void RegionManager::__map_persistent_region(){
     int result = write(fd, "", 1);
     assert(result != -1);
 
-    void * addr =
-        mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MMAP_FLAG, fd, 0);
-    assert(addr != MAP_FAILED);
+    __reserve_region();
+    __map_file(0, FILESIZE);
 
-    base_addr = (char*) addr;
     // | curr_addr  |
     // | heap_start |
     // |     size   |
-    new (((atomic_pptr<char>*) base_addr)) atomic_pptr<char>((char*) ((size_t)addr + PAGESIZE));
+    new (((atomic_pptr<char>*) base_addr)) atomic_pptr<char>((char*) ((size_t)base_addr + PAGESIZE));
     curr_addr_ptr = (atomic_pptr<char>*)base_addr;
     *(uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)) = FILESIZE;
 
     FLUSH(curr_addr_ptr);
     FLUSH((uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)));
     FLUSHFENCE;
-    DBG_PRINT("Addr: %p\n", addr);
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Current_addr: %p\n", curr_addr_ptr->load());
 }
@@ -89,23 +173,31 @@ void RegionManager::__remap_persistent_region(){
                 S_IRUSR | S_IWUSR);
 
     FD = fd;
+    // the file may have grown beyond the size asked for
+    struct stat st;
+    int result = fstat(fd, &st);
+    assert(result != -1);
+    if((uint64_t)st.st_size > FILESIZE)
+        FILESIZE = st.st_size;
+    assert(FILESIZE <= RESERVESIZE);
     off_t offt = lseek(fd, FILESIZE-1, SEEK_SET);
     assert(offt != -1);
 
-    int result = write(fd, "", 1);
+    result = write(fd, "", 1);
     assert(result != -1);
 
     offt = lseek(fd, 0, SEEK_SET);
     assert (offt == 0);
 
-    void * addr =
-        mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MMAP_FLAG, fd, 0);
-    assert(addr != MAP_FAILED);
+    __reserve_region();
+    __map_file(0, FILESIZE);
 
-    base_addr = (char*) addr;
     curr_addr_ptr = (atomic_pptr<char>*)base_addr;
-    assert(*(uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)) == FILESIZE);
-    DBG_PRINT("Addr: %p\n", addr);
+    uint64_t* size_ptr = (uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>));
+    assert(*size_ptr <= FILESIZE);
+    *size_ptr = FILESIZE;
+    FLUSH(size_ptr);
+    FLUSHFENCE;
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Curr_addr: %p\n", curr_addr_ptr->load());
 }
@@ -123,23 +215,19 @@ void RegionManager::__map_transient_region(){
     int result = write(fd, "", 1);
     assert(result != -1);
 
-    void * addr =
-        mmap(0, FILESIZE, PROT_READ | PROT_WRITE, 
-            MAP_SHARED | MAP_NORESERVE, fd, 0);
-    assert(addr != MAP_FAILED);
+    __reserve_region();
+    __map_file(0, FILESIZE);
 
-    base_addr = (char*) addr;
     // | curr_addr  |
     // | heap_start |
     // |     size   |
-    new (((atomic_pptr<char>*) base_addr)) atomic_pptr<char>((char*) ((size_t)addr + PAGESIZE));
+    new (((atomic_pptr<char>*) base_addr)) atomic_pptr<char>((char*) ((size_t)base_addr + PAGESIZE));
     curr_addr_ptr = (atomic_pptr<char>*)base_addr;
     *(uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)) = FILESIZE;
 
     FLUSH(curr_addr_ptr);
     FLUSH((uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)));
     FLUSHFENCE;
-    DBG_PRINT("Addr: %p\n", addr);
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Current_addr: %p\n", curr_addr_ptr->load());
 }
@@ -150,24 +238,31 @@ void RegionManager::__remap_transient_region(){
                 S_IRUSR | S_IWUSR);
 
     FD = fd;
+    // the file may have grown beyond the size asked for
+    struct stat st;
+    int result = fstat(fd, &st);
+    assert(result != -1);
+    if((uint64_t)st.st_size > FILESIZE)
+        FILESIZE = st.st_size;
+    assert(FILESIZE <= RESERVESIZE);
     off_t offt = lseek(fd, FILESIZE-1, SEEK_SET);
     assert(offt != -1);
 
-    int result = write(fd, "", 1);
+    result = write(fd, "", 1);
     assert(result != -1);
 
     offt = lseek(fd, 0, SEEK_SET);
     assert (offt == 0);
 
-    void * addr =
-        mmap(0, FILESIZE, PROT_READ | PROT_WRITE, 
-            MAP_SHARED | MAP_NORESERVE, fd, 0);
-    assert(addr != MAP_FAILED);
+    __reserve_region();
+    __map_file(0, FILESIZE);
 
-    base_addr = (char*) addr;
     curr_addr_ptr = (atomic_pptr<char>*)base_addr;
-    assert(*(uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>)) == FILESIZE);
-    DBG_PRINT("Addr: %p\n", addr);
+    uint64_t* size_ptr = (uint64_t*)((size_t)base_addr + 2*sizeof(atomic_pptr<char>));
+    assert(*size_ptr <= FILESIZE);
+    *size_ptr = FILESIZE;
+    FLUSH(size_ptr);
+    FLUSHFENCE;
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Curr_addr: %p\n", curr_addr_ptr->load());
 }
@@ -185,7 +280,7 @@ void RegionManager::__close_persistent_region(){
          ((unsigned long) FILESIZE - space_used) / (1024 * 1024);
     DBG_PRINT("Space Used(rounded down to MiB): %ld, Remaining(MiB): %ld\n", 
             space_used / (1024 * 1024), remaining_space);
-    munmap((void*)base_addr, FILESIZE);
+    munmap((void*)base_addr, RESERVESIZE);
     close(FD);
 }
 
@@ -204,7 +299,7 @@ void RegionManager::__close_transient_region(){
          ((unsigned long) FILESIZE - space_used) / (1024 * 1024);
     DBG_PRINT("Space Used(rounded down to MiB): %ld, Remaining(MiB): %ld\n", 
             space_used / (1024 * 1024), remaining_space);
-    munmap((void*)base_addr, FILESIZE);
+    munmap((void*)base_addr, RESERVESIZE);
     close(FD);
 }
 
@@ -237,13 +332,14 @@ int RegionManager::__nvm_region_allocator(void** memptr, size_t alignment, size_
 
     res = new_curr_addr;
     next = new_curr_addr + size;
-    if (next > base_addr + FILESIZE){
+    if (next > base_addr + FILESIZE && !__grow_region(next - base_addr)){
         printf("\n----Region Manager: out of space in mmaped file-----\nCurr:%p\nBase:%p\n",res,base_addr);
         return -1;
     }
     new_curr_addr = next;
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    // old_curr_addr may not be persisted yet, but there's no need to: its
+    // allocator hasn't returned, and new_curr_addr, on the same line and
+    // beyond it, is persisted before this one returns
     if(curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)){
         FLUSH(curr_addr_ptr);
         FLUSHFENCE;
@@ -271,13 +367,14 @@ int RegionManager::__try_nvm_region_allocator(void** memptr, size_t alignment, s
 
     res = new_curr_addr;
     next = new_curr_addr + size;
-    if (next > base_addr + FILESIZE){
+    if (next > base_addr + FILESIZE && !__grow_region(next - base_addr)){
         printf("\n----Region Manager: out of space in mmaped file-----\n");
         return -1;
     }
     new_curr_addr = next;
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    // old_curr_addr may not be persisted yet, but there's no need to: its
+    // allocator hasn't returned, and new_curr_addr, on the same line and
+    // beyond it, is persisted before this one returns
     if(curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)) {
         FLUSH(curr_addr_ptr);
         FLUSHFENCE;
@@ -288,6 +385,22 @@ int RegionManager::__try_nvm_region_allocator(void** memptr, size_t alignment, s
     }
 }
 
+int RegionManager::__extend_to(char* end){
+    char * old_curr_addr = curr_addr_ptr->load();
+    while (old_curr_addr < end){
+        if (end > base_addr + FILESIZE && !__grow_region(end - base_addr)){
+            printf("\n----Region Manager: out of space in mmaped file-----\n");
+            return -1;
+        }
+        if(curr_addr_ptr->compare_exchange_strong(old_curr_addr, end)){
+            FLUSH(curr_addr_ptr);
+            FLUSHFENCE;
+            return 1;
+        }
+    }
+    return 1;
+}
+
 bool RegionManager::__within_range(void* ptr){
     intptr_t curr_addr = (intptr_t)curr_addr_ptr->load();
     return ((intptr_t)base_addr<(intptr_t)ptr) && ((intptr_t)ptr<curr_addr);
@@ -38,6 +38,8 @@
 #include <fstream>
 #include <atomic>
 #include <vector>
+#include <mutex>
+#include <algorithm>
 
 #include "pm_config.hpp"
 #include "pfence_util.h"
@@ -53,18 +55,32 @@
  *	(the first page ends and heap starts here to which heap_start points)
  *	....
  *	(heap ends here to which curr_addr points)
+ *	...
+ *	(file ends here, at base_addr + FILESIZE)
+ *	...
+ *	(reserved address space ends here, at base_addr + RESERVESIZE)
+ *
+ * The whole RESERVESIZE bytes of address space are reserved when the region
+ * is mapped, but only the FILESIZE bytes the file holds are mapped. Once
+ * curr_addr would go past them, the file grows and the new part is mapped
+ * right after, so addresses in the region never change.
  */
 class RegionManager{
 public:
-    const uint64_t FILESIZE;
+    // bytes of file mapped; only grows, and size in the first page follows
+    std::atomic<uint64_t> FILESIZE;
+    const uint64_t RESERVESIZE;
     const std::string HEAPFILE;
     int FD = 0;
     char *base_addr = nullptr;
     atomic_pptr<char>* curr_addr_ptr;//this always points to the place of base_addr
     bool persist;
+    std::mutex grow_lock;
 
-    RegionManager(const std::string& file_path, uint64_t size, bool p = true, bool imm_expand = true):
+    // the region may grow up to max_size, or only has size if it's smaller
+    RegionManager(const std::string& file_path, uint64_t size, bool p = true, bool imm_expand = true, uint64_t max_size = 0):
         FILESIZE(((size/PAGESIZE)+2)*PAGESIZE), // size should align to page
+        RESERVESIZE(((std::max(size, max_size)/PAGESIZE)+2)*PAGESIZE),
         HEAPFILE(file_path),
         curr_addr_ptr(nullptr),
         persist(p){
@@ -112,6 +128,19 @@ public:
         return f.good();
     }
 
+    //reserve RESERVESIZE bytes of address space for base_addr
+    void __reserve_region();
+
+    //map bytes [from, to) of the file to the same offsets from base_addr
+    void __map_file(uint64_t from, uint64_t to);
+
+    //grow the file to hold at least size bytes; false if it can't
+    bool __grow_region(uint64_t size);
+
+    //page size the region is mapped by, i.e., HUGEPAGE_SIZE if its first
+    //huge page got a PMD mapping once faulted in, otherwise its base page size
+    uint64_t __page_size();
+
     //mmap file
     //the only difference between persist and trans version is
     //persist always map to the same addr while trans doesn't
@@ -144,6 +173,11 @@ public:
      */
     int __try_nvm_region_allocator(void** /*ret */, size_t /* alignment */, size_t /*size */);
 
+    /* move curr_addr forward to end unless it's already there or beyond.
+     * return 1 if succeeds, -1 if expansion is illegal
+     */
+    int __extend_to(char* /* end */);
+
     //true if ptr is in persistent region, otherwise false
     bool __within_range(void* ptr);
 
@@ -196,9 +230,9 @@ public:
     }
 
     /* to create desc or sb region */
-    void create(const std::string& file_path, uint64_t size, bool p = true, bool imm_expand = true){
+    void create(const std::string& file_path, uint64_t size, bool p = true, bool imm_expand = true, uint64_t max_size = 0){
         bool restart = exists_test(file_path);
-        RegionManager* new_mgr = new RegionManager(file_path,size,p,imm_expand);
+        RegionManager* new_mgr = new RegionManager(file_path,size,p,imm_expand,max_size);
         regions[cur_idx] = new_mgr;
         if(imm_expand || restart)
             regions_address[cur_idx] = (char*)new_mgr->__fetch_heap_start();
@@ -259,6 +293,12 @@ public:
         return regions[index]->__nvm_region_allocator(memptr, alignment, size);
     }
 
+    /* extend region $index$ to $end$ unless it already reaches there */
+    /* return 1 if succeeds, -1 if expansion is illegal (e.g., space runs out) */
+    inline int extend_to(int index, char* end){
+        return regions[index]->__extend_to(end);
+    }
+
     /* check if $ptr$ is in the range of region $index$ */
     inline bool in_range(int index, const void* ptr){
         bool ret = ptr >= regions_address[index];
@@ -271,9 +311,7 @@ public:
         RegionManager* target = regions[index];
         char* addr = regions_address[index];
         char* ending = target->curr_addr_ptr->load();
-        for(; addr < ending; addr += CACHELINE_SIZE) {
-            FLUSH(addr);
-        }
+        pwb_range(addr, ending);
         FLUSHFENCE;
     }
 };
@@ -14,12 +14,17 @@
 #include "pm_config.hpp"
 #include "SizeClass.hpp"
 
-// here we use same size for sbs in different sizeclass for easy management
+// small classes take a superblock, or a span of pages superblocks, which
+// block_size divides, if a superblock leaves too long a tail
+#define SB_SPAN(block_size, pages) \
+	(SBSIZE % (block_size) * SB_TAIL_WASTE_DIV > SBSIZE ? (pages) * SBSIZE : SBSIZE)
 #define SIZE_CLASS_bin_yes(block_size, pages) \
-	{ block_size, SBSIZE, SBSIZE/block_size, SBSIZE/block_size },
-/* #define SIZE_CLASS_bin_yes(block_size, pages) \
- 	{ block_size, pages * PAGESIZE, 0, 0 },
- 	*/
+	{ block_size, SB_SPAN(block_size, pages), SB_SPAN(block_size, pages) / block_size, \
+		SB_SPAN(block_size, pages) / block_size, SB_SPAN(block_size, pages) / block_size },
+// medium classes take a span of pages, a multiple of superblocks
+#define SIZE_CLASS_bin_med(block_size, pages) \
+	{ block_size, pages * PAGESIZE, pages * PAGESIZE / block_size, \
+		pages * PAGESIZE / block_size, pages * PAGESIZE / block_size },
 #define SIZE_CLASS_bin_no(block_size, pages)
 
 #define SC(index, lg_grp, lg_delta, ndelta, psz, bin, pgs, lg_delta_lookup) \
@@ -30,22 +35,36 @@ SizeClass ralloc::sizeclass;
 
 SizeClass::SizeClass():
 	sizeclasses{
-		{ 0, 0, 0, 0},
+		{ 0, 0, 0, 0, 0},
 		SIZE_CLASSES
 	},
-	sizeclass_lookup{0} {
+	flush_keep_pct(0),
+	fill_pct(100) {
 	// first size class reserved for large allocations
-	size_t lookupIdx = 0;
+	// check get_sizeclass agrees with the table on every class boundary
 	for (size_t sc_idx = 1; sc_idx < MAX_SZ_IDX; ++sc_idx)
 	{
-		SizeClassData const& sc = sizeclasses[sc_idx];
-		size_t block_size = sc.block_size;
-		while (lookupIdx <= block_size)
-		{
-			sizeclass_lookup[lookupIdx] = sc_idx;
-			++lookupIdx;
-		} 
+		size_t block_size = sizeclasses[sc_idx].block_size;
+		assert(get_sizeclass(block_size) == sc_idx);
+		assert(get_sizeclass(sizeclasses[sc_idx - 1].block_size + 1) == sc_idx);
+		(void)block_size;
 	}
+	assert(sizeclasses[MAX_SZ_IDX - 1].block_size == MAX_SZ);
+	for (size_t sc_idx = 1; sc_idx < MAX_SZ_IDX; ++sc_idx)
+		assert(sizeclasses[sc_idx].sb_size % SBSIZE == 0);
 }
 
 
+
+void SizeClass::set_cache_bounds(uint32_t min, uint32_t max){
+	for (size_t sc_idx = 1; sc_idx < MAX_SZ_IDX; ++sc_idx)
+	{
+		SizeClassData& sc = sizeclasses[sc_idx];
+		uint32_t hi = max < sc.block_num ? max : sc.block_num;
+		if (hi == 0) hi = 1;
+		uint32_t lo = min < hi ? min : hi;
+		if (lo == 0) lo = 1;
+		sc.cache_block_num = hi;
+		sc.cache_min_block_num = lo;
+	}
+}
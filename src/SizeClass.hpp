@@ -30,9 +30,26 @@
  * and get_sizeclass. To use, just instantiate SizeClass and call 
  * get_sizeclass(size). SizeClass is safe to have multiple instances.
  *
+ * Classes up to MAX_SMALL_SZ (bin yes) keep their blocks in a superblock,
+ * unless it leaves a tail over 1/SB_TAIL_WASTE_DIV of it; such classes take
+ * a span of pgs superblocks instead, which their block size divides.
+ * Medium classes (bin med) up to MAX_SZ keep them in a span of pgs pages,
+ * a multiple of superblocks holding at least 4 blocks with the least tail
+ * waste; like small ones, they are spaced by a quarter of their doubling,
+ * so internal fragmentation is bound by 25%.
+ *
+ * Size to size class index is computed arithmetically from the parameters
+ * of SIZE_CLASSES (see size2index in jemalloc) rather than looked up in a
+ * table covering every size up to MAX_SZ, so it doesn't take any cache.
+ *
  * Wentao Cai (wcai6@cs.rochester.edu)
  */
 
+// log2 of the spacing of the first group of size classes
+const size_t SC_LG_QUANTUM = 3;
+// log2 of the number of size classes in each size doubling
+const size_t SC_LG_NGROUP = 2;
+
 // contains size classes
 struct SizeClassData
 {
@@ -40,12 +57,14 @@ public:
 	// size of block
 	uint32_t block_size;
 	// superblock size
-	// always a multiple of page size
+	// always a multiple of SBSIZE; more than one makes a span
 	uint32_t sb_size;
 	// cached number of blocks, equal to sb_size / block_size
 	uint32_t block_num;
-	// number of blocks held by thread-specific caches
+	// max number of blocks held by thread-specific caches
 	uint32_t cache_block_num;
+	// min capacity of thread-specific caches, in blocks
+	uint32_t cache_min_block_num;
 
 public:
 	size_t get_block_num() const { return block_num; }
@@ -54,10 +73,40 @@ public:
 class SizeClass{
 private:
 	SizeClassData sizeclasses[MAX_SZ_IDX];
-	size_t sizeclass_lookup[MAX_SZ + 1];
+	// percentage of capacity a thread cache bin keeps when it overflows
+	uint32_t flush_keep_pct;
+	// percentage of capacity a thread cache bin is filled to on refill
+	uint32_t fill_pct;
 public:
 	SizeClass();
-	inline size_t get_sizeclass(size_t size){return sizeclass_lookup[size];}
+	// clamp thread cache capacity of every size class to [min, max] blocks
+	void set_cache_bounds(uint32_t min, uint32_t max);
+	// set percentage of capacity kept by an overflowing bin; 0 drains it
+	void set_flush_keep(uint32_t pct){flush_keep_pct = pct < 100 ? pct : 99;}
+	// set percentage of capacity a bin is filled to on refill
+	void set_fill(uint32_t pct){fill_pct = pct == 0 ? 1 : (pct > 100 ? 100 : pct);}
+	// number of blocks an empty bin with capacity limit should be filled to
+	inline uint32_t get_fill_target(uint32_t limit){
+		uint32_t target = (uint32_t)((uint64_t)limit * fill_pct / 100);
+		return target > 0 ? target : 1;
+	}
+	// number of blocks an overflowing bin with capacity limit should keep
+	inline uint32_t get_flush_keep(uint32_t limit){
+		uint32_t keep = (uint32_t)((uint64_t)limit * flush_keep_pct / 100);
+		return keep < limit ? keep : limit - 1;
+	}
+	// size must be no larger than MAX_SZ; size 0 goes to the smallest class
+	static inline size_t get_sizeclass(size_t size){
+		// classes of each doubling (n, 2n] are spaced by n>>SC_LG_NGROUP,
+		// except the first group, spaced by quantum; so lg below is the
+		// doubling of size-1, with the first group taken as the next one
+		size_t n = size - (size != 0);
+		size_t lg = 63 - __builtin_clzll(n | (1ULL << (SC_LG_QUANTUM + SC_LG_NGROUP)));
+		// n >> (lg - SC_LG_NGROUP) is 1<<SC_LG_NGROUP plus the offset in group,
+		// or just n/quantum in the first group; idx 0 is reserved
+		return ((lg - (SC_LG_QUANTUM + SC_LG_NGROUP)) << SC_LG_NGROUP) +
+			(n >> (lg - SC_LG_NGROUP)) + 1;
+	}
 	inline SizeClassData* get_sizeclass_by_idx(size_t idx){return &sizeclasses[idx];}
 };
 namespace ralloc{
@@ -116,27 +165,27 @@ namespace ralloc{
 	SC( 36,	 13,	   11,	  1,  no, yes,   5, no) \
 	SC( 37,	 13,	   11,	  2, yes, yes,   3, no) \
 	SC( 38,	 13,	   11,	  3,  no, yes,   7, no) \
-	SC( 39,	 13,	   11,	  4, yes,  no,   0, no) \
-														 \
-	SC( 40,	 14,	   12,	  1, yes,  no,   0, no) \
-	SC( 41,	 14,	   12,	  2, yes,  no,   0, no) \
-	SC( 42,	 14,	   12,	  3, yes,  no,   0, no) \
-	SC( 43,	 14,	   12,	  4, yes,  no,   0, no) \
-														 \
-	SC( 44,	 15,	   13,	  1, yes,  no,   0, no) \
-	SC( 45,	 15,	   13,	  2, yes,  no,   0, no) \
-	SC( 46,	 15,	   13,	  3, yes,  no,   0, no) \
-	SC( 47,	 15,	   13,	  4, yes,  no,   0, no) \
-														 \
-	SC( 48,	 16,	   14,	  1, yes,  no,   0, no) \
-	SC( 49,	 16,	   14,	  2, yes,  no,   0, no) \
-	SC( 50,	 16,	   14,	  3, yes,  no,   0, no) \
-	SC( 51,	 16,	   14,	  4, yes,  no,   0, no) \
-														 \
-	SC( 52,	 17,	   15,	  1, yes,  no,   0, no) \
-	SC( 53,	 17,	   15,	  2, yes,  no,   0, no) \
-	SC( 54,	 17,	   15,	  3, yes,  no,   0, no) \
-	SC( 55,	 17,	   15,	  4, yes,  no,   0, no) \
+	SC( 39,	 13,	   11,	  4, yes, med,  16, no) \
+														 \
+	SC( 40,	 14,	   12,	  1, yes, med,  32, no) \
+	SC( 41,	 14,	   12,	  2, yes, med,  48, no) \
+	SC( 42,	 14,	   12,	  3, yes, med,  64, no) \
+	SC( 43,	 14,	   12,	  4, yes, med,  32, no) \
+														 \
+	SC( 44,	 15,	   13,	  1, yes, med,  80, no) \
+	SC( 45,	 15,	   13,	  2, yes, med,  48, no) \
+	SC( 46,	 15,	   13,	  3, yes, med, 112, no) \
+	SC( 47,	 15,	   13,	  4, yes, med,  64, no) \
+														 \
+	SC( 48,	 16,	   14,	  1, yes, med,  80, no) \
+	SC( 49,	 16,	   14,	  2, yes, med,  96, no) \
+	SC( 50,	 16,	   14,	  3, yes, med, 112, no) \
+	SC( 51,	 16,	   14,	  4, yes, med, 128, no) \
+														 \
+	SC( 52,	 17,	   15,	  1, yes, med, 160, no) \
+	SC( 53,	 17,	   15,	  2, yes, med, 192, no) \
+	SC( 54,	 17,	   15,	  3, yes, med, 224, no) \
+	SC( 55,	 17,	   15,	  4, yes, med, 256, no) \
 														 \
 	SC( 56,	 18,	   16,	  1, yes,  no,   0, no) \
 	SC( 57,	 18,	   16,	  2, yes,  no,   0, no) \
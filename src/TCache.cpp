@@ -11,45 +11,145 @@
  * is retained. See LICENSE for details about MIT License.
  */
 
+#include <sched.h>
+
 #include "TCache.hpp"
 
 using namespace ralloc;
-thread_local TCaches ralloc::t_caches;
+__thread TCaches ralloc::t_caches RP_TLS_MODEL;
+static thread_local TCachesFinalizer t_finalizer;
+bool ralloc::remote_free = REMOTE_FREE;
+RemoteSlot ralloc::remote_slots[REMOTE_SLOTS];
+std::mutex ralloc::tcaches_mtx;
+TCaches* ralloc::tcaches_head = nullptr;
 
-void TCacheBin::push_block(char* block)
+void TCacheBin::push_list(char* block, char* tail, uint32_t length)
 {
-	// block has at least sizeof(char*)
-	*(pptr<char>*)block = _block;
+	// this op is only used to fill cache
+	if (_block_num > 0) {
+		assert(tail != nullptr);
+		*(pptr<char>*)tail = _block;
+	}
+
 	_block = block;
-	_block_num++;
+	_block_num += length;
 }
 
-void TCacheBin::push_list(char* block, uint32_t length)
+void TCacheBin::pop_list(char* block, uint32_t length)
 {
-	// caller must ensure there's no available block
-	// this op is only used to fill empty cache
-	assert(_block_num == 0);
+	assert(_block_num >= length);
 
 	_block = block;
-	_block_num = length;
+	_block_num -= length;
 }
 
-char* TCacheBin::pop_block()
+char* TCacheBin::split(uint32_t keep)
 {
-	// caller must ensure there's an available block
-	assert(_block_num > 0);
+	assert(keep < _block_num);
+	if (keep == 0) {
+		char* ret = _block;
+		_block = nullptr;
+		_block_num = 0;
+		return ret;
+	}
+	char* last = _block;
+	for (uint32_t i = 1; i < keep; i++)
+		last = (char*)(*(pptr<char>*)last);
+	_block_num = keep;
+	return (char*)(*(pptr<char>*)last);
+}
 
-	char* ret = _block;
-	char* next = (char*)(*(pptr<char>*)ret);
-	_block = next;
-	_block_num--;
-	return ret;
+void TCacheBin::on_fill(uint32_t min, uint32_t max)
+{
+	_active = true;
+	_overflows = 0;
+	if (_limit < min)
+		_limit = min;
+	else if (_limit < max)
+		_limit = (_limit * 2 < max) ? _limit * 2 : max;
 }
 
-void TCacheBin::pop_list(char* block, uint32_t length)
+bool TCacheBin::on_overflow(uint32_t min, uint32_t max)
 {
-	assert(_block_num >= length);
+	if (_limit == 0) {
+		// first free into a bin that has never been filled
+		_limit = min;
+		return _block_num >= _limit;
+	}
+	_active = true;
+	if (++_overflows > TCACHE_MAX_OVERFLOWS) {
+		// keep overflowing without a fill in between: mostly freeing
+		_overflows = 0;
+		_limit = (_limit / 2 > min) ? _limit / 2 : min;
+	}
+	return true;
+}
 
-	_block = block;
-	_block_num -= length;
+void TCacheBin::decay(uint32_t min)
+{
+	if (!_active && _limit > min)
+		_limit = (_limit / 2 > min) ? _limit / 2 : min;
+	_active = false;
+}
+
+void TCacheBin::shrink(uint32_t min)
+{
+	if (_limit > min)
+		_limit = min;
+	_overflows = 0;
+}
+
+void RemoteBatch::push_block(char* block)
+{
+	if (count == 0)
+		tail = block;
+	*(pptr<char>*)block = head;
+	head = block;
+	count++;
+}
+
+void TCaches::do_register_finalizer()
+{
+	// first use of t_finalizer in this thread registers its destructor
+	t_finalizer.registered = true;
+	finalizer_registered = true;
+
+	std::lock_guard<std::mutex> lk(tcaches_mtx);
+	reg_prev = nullptr;
+	reg_next = tcaches_head;
+	if (tcaches_head != nullptr)
+		tcaches_head->reg_prev = this;
+	tcaches_head = this;
+}
+
+void TCaches::on_trim_request()
+{
+	uint32_t state = trim_state.load(std::memory_order_acquire);
+	while (state != TRIM_NONE) {
+		if (state == TRIM_REQUESTED) {
+			// we're active, cancel it; fails if trimmer starts draining
+			if (trim_state.compare_exchange_weak(state, TRIM_NONE))
+				return;
+		} else {
+			sched_yield();
+			state = trim_state.load(std::memory_order_acquire);
+		}
+	}
+}
+
+TCachesFinalizer::~TCachesFinalizer()
+{
+	TCaches* tc = &t_caches;
+	if (tc->finalizer_registered) {
+		// waits for trimmer if it's draining this cache
+		std::lock_guard<std::mutex> lk(tcaches_mtx);
+		if (tc->reg_prev != nullptr)
+			tc->reg_prev->reg_next = tc->reg_next;
+		else
+			tcaches_head = tc->reg_next;
+		if (tc->reg_next != nullptr)
+			tc->reg_next->reg_prev = tc->reg_prev;
+		tc->finalizer_registered = false;
+	}
+	ralloc::public_flush_cache();
 }
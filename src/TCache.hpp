@@ -14,6 +14,9 @@
 #ifndef __TCACHE_H_
 #define __TCACHE_H_
 
+#include <atomic>
+#include <mutex>
+
 #include "pm_config.hpp"
 #include "pfence_util.h"
 #include "SizeClass.hpp"
@@ -24,58 +27,237 @@
  * This is from LRMALLOC:
  * https://github.com/ricleite/lrmalloc
  * 
- * This defines thread-local cache, using C++ TLS.
+ * This defines thread-local cache, using TLS.
  * During normal exit, all cached blocks will be given back to superblocks.
  * 
  * The head (_block) of each cache list uses absolute address while
  * the list itself is linked by pptr since block free list is linked by pptr.
  *
- * In the destructor of TCacheBin, all blocks will be flushed back to their 
- * superblock as long as ralloc::initialized is true.
+ * TCaches is plain zero-initialized __thread data, so that the inline fast
+ * path in ralloc.hpp reaches it without any TLS wrapper call. Instead of its
+ * destructor, a separate thread_local TCachesFinalizer registered on the
+ * first slow path of the thread flushes all blocks back to their superblock
+ * as long as ralloc::initialized is true.
+ *
+ * Each bin has an adaptive capacity (_limit) bounded by the min and max of its
+ * size class: it doubles whenever the bin has to be refilled, and halves once
+ * the bin overflows TCACHE_MAX_OVERFLOWS times in a row or stays untouched
+ * for a whole decay round (see TCaches::tick).
+ *
+ * With remote free enabled, each thread also owns a RemoteSlot, and a
+ * superblock remembers the slot of the thread that last filled its cache from
+ * it (Descriptor::owner). Frees of such blocks by other threads are batched
+ * per (owner, size class) in RemoteBatch and handed over to the owner's slot
+ * by a single CAS; the owner adopts the whole list by a single exchange
+ * the next time it refills that size class.
+ *
+ * Threads that have cached anything are linked in a registry, so that the
+ * optional background trimmer can drain caches of threads idle for a whole
+ * trim interval. Every Ralloc call of a thread runs between TCacheGuard's
+ * enter() and leave(), which set TCaches::busy and check trim_state; with a
+ * membarrier() on the trimmer side this is an asymmetric Dekker handshake,
+ * so the fast path pays no fence. See BaseMeta::trim_idle_caches.
  * 
  * Wentao Cai (wcai6@cs.rochester.edu)
  */
 
 struct TCaches;
 
+// how much a thread cache is trimmed
+enum TrimLevel {
+	// shrink capacity of bins idle since the last decay round, and flush
+	// blocks beyond it
+	TRIM_IDLE = 0,
+	// shrink capacity of all bins to min, and flush blocks beyond it
+	TRIM_MIN = 1,
+	// flush all bins, pending remote frees and blocks freed to us by other
+	// threads, and shrink capacity to min
+	TRIM_ALL = 2,
+};
+
+// TCaches::trim_state
+enum TrimState {
+	// nothing from trimmer
+	TRIM_NONE = 0,
+	// trimmer will drain the cache unless the thread runs before that
+	TRIM_REQUESTED = 1,
+	// trimmer is draining the cache, the thread must wait
+	TRIM_DRAINING = 2,
+};
+
 struct TCacheBin
 {
 private:
 	char* _block;//absolute address of block
 	uint32_t _block_num;
+	// current capacity; 0 until the first fill or flush sets it to min
+	uint32_t _limit;
+	// overflows since the last fill
+	uint16_t _overflows;
+	// true if the bin was filled or flushed since the last decay round
+	bool _active;
 
 public:
 	// common, fast ops
-	void push_block(char* block);
-	// push block list, cache *must* be empty
-	void push_list(char* block, uint32_t length);
+	inline void push_block(char* block){
+		// block has at least sizeof(char*)
+		*(pptr<char>*)block = _block;
+		_block = block;
+		_block_num++;
+	}
+	// push block list ending at tail in front of cached blocks,
+	// tail is only needed if the cache isn't empty
+	void push_list(char* block, char* tail, uint32_t length);
+
+	inline char* pop_block(){
+		// caller must ensure there's an available block
+		assert(_block_num > 0);
 
-	char* pop_block(); // can return nullptr
+		char* ret = _block;
+		_block = (char*)(*(pptr<char>*)ret);
+		_block_num--;
+		return ret;
+	}
 	// manually popped list of blocks and now need to update cache
 	// `block` is the new head
 	void pop_list(char* block, uint32_t length);
 	char* peek_block() const { return _block; }
+	// keep the first (most recently pushed) keep blocks and detach the rest,
+	// `keep` must be less than number of blocks
+	// return head of the detached list
+	char* split(uint32_t keep);
 
 	uint32_t get_block_num() const { return _block_num; }
-	TCacheBin() noexcept:_block(nullptr), _block_num(0) {};
+	uint32_t get_limit() const { return _limit; }
+
+	// capacity policy, called from the slow paths with bounds of size class
+	// grow the capacity before the bin gets refilled
+	void on_fill(uint32_t min, uint32_t max);
+	// return true if the bin should be flushed
+	bool on_overflow(uint32_t min, uint32_t max);
+	// shrink the capacity if the bin has been idle since the last call
+	void decay(uint32_t min);
+	// shrink the capacity to min
+	void shrink(uint32_t min);
+
+	// no constructor: an all-zero bin is empty, and zeroed in TLS
 	// slow operations like fill/flush handled in cache user
 };
 
+// blocks freed by other threads, waiting to be adopted by the slot owner
+struct RemoteSlot
+{
+	// true if a thread owns this slot
+	std::atomic<bool> in_use;
+	// per size class stacks of blocks, linked by pptr; only pushed in batch
+	// and drained as a whole so there's no ABA
+	std::atomic<char*> lists[MAX_SZ_IDX];
+	RemoteSlot() noexcept:in_use(false), lists() {};
+}__attribute__((aligned(CACHELINE_SIZE)));
+
+// remote frees of one (owner, size class) not handed over yet
+struct RemoteBatch
+{
+	char* head;
+	char* tail;
+	uint32_t owner; // 1-based slot index
+	uint32_t sc_idx;
+	uint32_t count;
+	void push_block(char* block);
+};
+
 namespace ralloc{
 	extern void public_flush_cache();
+	// whether remote free is enabled
+	extern bool remote_free;
+	extern RemoteSlot remote_slots[REMOTE_SLOTS];
+	// registry of TCaches of live threads
+	extern std::mutex tcaches_mtx;
+	extern TCaches* tcaches_head;
+	// true while the background trimmer runs; set before and cleared after
+	// any other thread can make Ralloc calls
+	extern bool trimmer_running;
 }
+// all fields start as zero in TLS, so no constructor or destructor
 struct TCaches
 {
 	TCacheBin t_cache[MAX_SZ_IDX];
-	TCaches():t_cache(){};
-	~TCaches(){
-		ralloc::public_flush_cache();
+	// slow path events since the last decay step
+	uint32_t events;
+	// last bin visited in decay
+	uint32_t decay_idx;
+	// 1-based index of the remote slot owned by this thread, 0 if none
+	uint32_t remote_slot;
+	// true once we tried to get a remote slot
+	bool remote_tried;
+	// true once TCachesFinalizer of this thread is registered
+	bool finalizer_registered;
+	RemoteBatch remote[REMOTE_BATCHES];
+	// 1 while the thread is in a Ralloc call; written by its thread only
+	std::atomic<uint32_t> busy;
+	// TrimState, see TCacheGuard
+	std::atomic<uint32_t> trim_state;
+	// links in registry, protected by tcaches_mtx
+	TCaches* reg_prev;
+	TCaches* reg_next;
+	// used by trimmer only: idle for a whole round
+	bool trim_candidate;
+
+	// called at the beginning and the end of every Ralloc call of the thread
+	inline void enter(){
+		busy.store(1, std::memory_order_relaxed);
+		// membarrier() of trimmer orders the store above and the load below
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if(UNLIKELY(trim_state.load(std::memory_order_acquire) != TRIM_NONE))
+			on_trim_request();
+	}
+	inline void leave(){
+		busy.store(0, std::memory_order_release);
+	}
+	// cancel a trim request, or wait until trimmer finishes draining
+	void on_trim_request();
+	// make sure blocks cached by this thread are flushed when it exits;
+	// must be called by slow paths before they leave anything in TCaches
+	inline void register_finalizer(){
+		if(UNLIKELY(!finalizer_registered)) do_register_finalizer();
+	}
+	void do_register_finalizer();
+	// batch a remote free to owner can go to
+	inline RemoteBatch* remote_batch(uint32_t owner, size_t sc_idx){
+		return &remote[(owner * MAX_SZ_IDX + sc_idx) & (REMOTE_BATCHES - 1)];
+	}
+	// count a slow path event; return the index of a bin to decay, or 0
+	inline size_t tick(){
+		if(LIKELY(++events < TCACHE_DECAY_INTERVAL)) return 0;
+		events = 0;
+		if(++decay_idx >= MAX_SZ_IDX) decay_idx = 1; // sc 0 is reserved
+		return decay_idx;
 	}
 };
 
+// unregisters and flushes TCaches of its thread during thread exit
+struct TCachesFinalizer
+{
+	bool registered;
+	~TCachesFinalizer();
+};
+
 /* thread-local cache */
 namespace ralloc{
-	extern thread_local TCaches t_caches;
+	extern __thread TCaches t_caches RP_TLS_MODEL;
 }
+
+// scope of a Ralloc call that touches thread cache; must not nest. Without
+// trimmer nobody else touches the cache, so there's no handshake
+struct TCacheGuard
+{
+	bool entered;
+	TCacheGuard(): entered(ralloc::trimmer_running){
+		if(UNLIKELY(entered)) ralloc::t_caches.enter();
+	}
+	~TCacheGuard(){
+		if(UNLIKELY(entered)) ralloc::t_caches.leave();
+	}
+};
 #endif // __TCACHE_H_
 
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#include "pfence_util.h"
+
+#include <cpuid.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "pm_config.hpp"
+
+// cpuid leaf 1 edx, absent from older cpuid.h
+#ifndef bit_CLFSH
+#define bit_CLFSH (1 << 19)
+#endif
+
+uint8_t pwb_kind = PWB_KIND_CLFLUSH;
+
+static bool pwb_supported(uint8_t kind){
+    unsigned int eax, ebx, ecx, edx;
+    switch(kind){
+    case PWB_KIND_CLFLUSH:
+        // every x86-64 has it, but ask anyway
+        if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (edx & bit_CLFSH) != 0;
+    case PWB_KIND_CLWB:
+        if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (ebx & bit_CLWB) != 0;
+    case PWB_KIND_CLFLUSHOPT:
+        if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (ebx & bit_CLFLUSHOPT) != 0;
+    default:
+        return false;
+    }
+}
+
+uint8_t pwb_select(uint8_t requested){
+#if defined(PWB_IS_RUNTIME)
+    if(requested == PWB_KIND_NONE || !pwb_supported(requested)){
+        requested = PWB_KIND_CLFLUSH;
+        if(pwb_supported(PWB_KIND_CLFLUSHOPT))
+            requested = PWB_KIND_CLFLUSHOPT;
+        if(pwb_supported(PWB_KIND_CLWB))
+            requested = PWB_KIND_CLWB;
+    }
+    pwb_kind = requested;
+    return pwb_kind;
+#elif defined(PWB_IS_CLWB)
+    return PWB_KIND_CLWB;
+#elif defined(PWB_IS_CLFLUSHOPT)
+    return PWB_KIND_CLFLUSHOPT;
+#elif defined(PWB_IS_CLFLUSH)
+    return PWB_KIND_CLFLUSH;
+#else
+    return PWB_KIND_NONE;
+#endif
+}
+
+const char* pwb_name(uint8_t kind){
+    switch(kind){
+    case PWB_KIND_CLFLUSH: return "clflush";
+    case PWB_KIND_CLWB: return "clwb";
+    case PWB_KIND_CLFLUSHOPT: return "clflushopt";
+    default: return "none";
+    }
+}
+
+#ifdef PWB_IS_RUNTIME
+// one loop per instruction, so the range is flushed with one branch
+#define PWB_RANGE_LOOP(insn) \
+    for(; addr < (const char*)end; addr += CACHELINE_SIZE) \
+        asm volatile (insn " (%0)" :: "r"(addr))
+
+void pwb_range(const void* start, const void* end){
+    const char* addr = (const char*)((uint64_t)start & ~CACHELINE_MASK);
+    if(pwb_kind == PWB_KIND_CLWB)
+        PWB_RANGE_LOOP("clwb");
+    else if(pwb_kind == PWB_KIND_CLFLUSHOPT)
+        PWB_RANGE_LOOP("clflushopt");
+    else if(pwb_kind == PWB_KIND_CLFLUSH)
+        PWB_RANGE_LOOP("clflush");
+}
+#undef PWB_RANGE_LOOP
+#else
+void pwb_range(const void* start, const void* end){
+    const char* addr = (const char*)((uint64_t)start & ~CACHELINE_MASK);
+    for(; addr < (const char*)end; addr += CACHELINE_SIZE)
+        FLUSH(addr);
+}
+#endif
+
+#if defined(PWB_IS_RUNTIME) || defined(PWB_IS_CLWB) || \
+    defined(PWB_IS_CLFLUSHOPT) || defined(PWB_IS_CLFLUSH)
+// non-temporal stores of whole lines; dst and n are multiples of
+// CACHELINE_SIZE, and src may be unaligned
+__attribute__((target("avx512f")))
+static void nt_set_avx512(char* dst, int c, size_t n){
+    __m512i v = _mm512_set1_epi8((char)c);
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE)
+        _mm512_stream_si512((__m512i*)dst, v);
+}
+
+__attribute__((target("avx2")))
+static void nt_set_avx2(char* dst, int c, size_t n){
+    __m256i v = _mm256_set1_epi8((char)c);
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE){
+        _mm256_stream_si256((__m256i*)dst, v);
+        _mm256_stream_si256((__m256i*)(dst + 32), v);
+    }
+}
+
+static void nt_set_sse2(char* dst, int c, size_t n){
+    __m128i v = _mm_set1_epi8((char)c);
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE){
+        _mm_stream_si128((__m128i*)dst, v);
+        _mm_stream_si128((__m128i*)(dst + 16), v);
+        _mm_stream_si128((__m128i*)(dst + 32), v);
+        _mm_stream_si128((__m128i*)(dst + 48), v);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void nt_copy_avx512(char* dst, const char* src, size_t n){
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE, src += CACHELINE_SIZE)
+        _mm512_stream_si512((__m512i*)dst, _mm512_loadu_si512(src));
+}
+
+__attribute__((target("avx2")))
+static void nt_copy_avx2(char* dst, const char* src, size_t n){
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE, src += CACHELINE_SIZE){
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+    }
+}
+
+static void nt_copy_sse2(char* dst, const char* src, size_t n){
+    for(char* end = dst + n; dst < end; dst += CACHELINE_SIZE, src += CACHELINE_SIZE){
+        for(int i = 0; i < CACHELINE_SIZE; i += 16)
+            _mm_stream_si128((__m128i*)(dst + i),
+                _mm_loadu_si128((const __m128i*)(src + i)));
+    }
+}
+
+void persist_memset(void* dst, int c, size_t n){
+    if(n < NT_STORE_THRESHOLD){
+        memset(dst, c, n);
+        pwb_range(dst, (char*)dst + n);
+        FLUSHFENCE;
+        return;
+    }
+    char* start = (char*)dst;
+    char* end = start + n;
+    char* body = ALIGN_ADDR(start, CACHELINE_SIZE);
+    char* body_end = (char*)((uint64_t)end & ~CACHELINE_MASK);
+    // partial lines at both ends go through cache
+    if(body != start){
+        memset(start, c, body - start);
+        FLUSH(start);
+    }
+    if(body_end != end){
+        memset(body_end, c, end - body_end);
+        FLUSH(body_end);
+    }
+    if(__builtin_cpu_supports("avx512f"))
+        nt_set_avx512(body, c, body_end - body);
+    else if(__builtin_cpu_supports("avx2"))
+        nt_set_avx2(body, c, body_end - body);
+    else
+        nt_set_sse2(body, c, body_end - body);
+    // non-temporal stores need it even if flushes don't
+    asm volatile ("sfence" ::: "memory");
+}
+
+void persist_memcpy(void* dst, const void* src, size_t n){
+    if(n < NT_STORE_THRESHOLD){
+        memcpy(dst, src, n);
+        pwb_range(dst, (char*)dst + n);
+        FLUSHFENCE;
+        return;
+    }
+    char* start = (char*)dst;
+    char* end = start + n;
+    char* body = ALIGN_ADDR(start, CACHELINE_SIZE);
+    char* body_end = (char*)((uint64_t)end & ~CACHELINE_MASK);
+    const char* body_src = (const char*)src + (body - start);
+    if(body != start){
+        memcpy(start, src, body - start);
+        FLUSH(start);
+    }
+    if(body_end != end){
+        memcpy(body_end, body_src + (body_end - body), end - body_end);
+        FLUSH(body_end);
+    }
+    if(__builtin_cpu_supports("avx512f"))
+        nt_copy_avx512(body, body_src, body_end - body);
+    else if(__builtin_cpu_supports("avx2"))
+        nt_copy_avx2(body, body_src, body_end - body);
+    else
+        nt_copy_sse2(body, body_src, body_end - body);
+    asm volatile ("sfence" ::: "memory");
+}
+#else
+// flushes are emulated or disabled, so are non-temporal stores
+void persist_memset(void* dst, int c, size_t n){
+    memset(dst, c, n);
+    pwb_range(dst, (char*)dst + n);
+    FLUSHFENCE;
+}
+
+void persist_memcpy(void* dst, const void* src, size_t n){
+    memcpy(dst, src, n);
+    pwb_range(dst, (char*)dst + n);
+    FLUSHFENCE;
+}
+#endif
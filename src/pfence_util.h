@@ -8,31 +8,91 @@
 #define PFENCE_UTIL_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
- * This file contains 3 versions of flush and fence macros:
+ * This file contains flush and fence macros in several versions:
  * 1. PWB_IS_CLFLUSH
  *    This uses clflush as flush, and noop as fence since (sequential) clflush
  *    doesn't need explicit fence to order.
  * 2. PWB_IS_CLWB
  *    This uses clwb as flush and sfence as fence.
- * 3. PWB_IS_PCM
+ * 3. PWB_IS_CLFLUSHOPT
+ *    This uses clflushopt as flush and sfence as fence. Like clwb, and unlike
+ *    clflush, it's only ordered with stores and flushes to the same line, so
+ *    it's much faster when flushing many lines and needs the fence.
+ * 4. PWB_IS_PCM
  *    This only emulates the latency of persistent memory and has no effect on
  *    writeback behavior.
- * 
- * To be compatible on machines with no clwb (which usually aren't equipped by
- * real persistent memory), we use macro SHM_SIMULATING to switch between
- * clflush and clwb.
+ * 5. PWB_IS_NOOP
+ *    This does nothing, for benchmarking without persistence.
+ * 6. none of above (default)
+ *    The flush is chosen at runtime by pwb_select(), called by RP_init, among
+ *    those the CPU supports, and FLUSH and FLUSHFENCE branch on it. The branch
+ *    never changes after init, so it's always predicted and costs much less
+ *    than an indirect call. Loops flushing a range should use pwb_range(),
+ *    which branches once for the whole range.
  */
 
 // Uncomment to enable durable linearizability
 #define DUR_LIN
 
-#ifdef SHM_SIMULATING
-  #define PWB_IS_CLFLUSH
-#else
-  #define PWB_IS_CLWB
-#endif
+// flush instructions to choose from at runtime
+enum PwbKind : uint8_t {
+    PWB_KIND_NONE = 0,
+    PWB_KIND_CLFLUSH = 1,
+    PWB_KIND_CLWB = 2,
+    PWB_KIND_CLFLUSHOPT = 3,
+    PWB_KIND_LAST = PWB_KIND_CLFLUSHOPT
+};
+
+// chosen flush; clflush, which every x86-64 has, until pwb_select() is called
+extern uint8_t pwb_kind;
+
+/*
+ * function pwb_select()
+ *
+ * Description:
+ *  Choose the flush for the rest of the run and return it: requested if
+ *  it's not PWB_KIND_NONE and the CPU supports it, otherwise the fastest
+ *  one the CPU supports, i.e., clwb > clflushopt > clflush. If the flush is fixed by a
+ *  PWB_IS_* macro, requested is ignored and that one is returned.
+ */
+uint8_t pwb_select(uint8_t requested);
+
+// name of a PwbKind, e.g., "clwb"
+const char* pwb_name(uint8_t kind);
+
+// flush all cache lines in [start, end) without fence
+void pwb_range(const void* start, const void* end);
+
+/*
+ * functions persist_memset() and persist_memcpy()
+ *
+ * Description:
+ *  memset() and memcpy() whose result is persisted when they return. From
+ *  NT_STORE_THRESHOLD bytes on, whole lines are written by non-temporal
+ *  stores, AVX-512, AVX2 or SSE2 ones as the CPU has, which go around the
+ *  cache and need no flush, and are ordered by an sfence. Smaller ones, and
+ *  partial lines at both ends, are stored to cache and flushed.
+ */
+void persist_memset(void* dst, int c, size_t n);
+void persist_memcpy(void* dst, const void* src, size_t n);
+
+static inline void pwb_runtime(const void* addr){
+    if(__builtin_expect(pwb_kind == PWB_KIND_CLWB, 1))
+        asm volatile ("clwb (%0)" :: "r"(addr));
+    else if(pwb_kind == PWB_KIND_CLFLUSHOPT)
+        asm volatile ("clflushopt (%0)" :: "r"(addr));
+    else if(pwb_kind == PWB_KIND_CLFLUSH)
+        asm volatile ("clflush (%0)" :: "r"(addr));
+}
+
+static inline void pfence_runtime(){
+    // clflush is ordered with stores and other clflushes
+    if(pwb_kind != PWB_KIND_CLFLUSH)
+        asm volatile ("sfence" ::: "memory");
+}
 
 #ifdef DUR_LIN
   #ifdef PWB_IS_NOOP
@@ -44,11 +104,16 @@
   #elif defined(PWB_IS_CLWB)
     #define FLUSH(addr) asm volatile ("clwb (%0)" :: "r"(addr))
     #define FLUSHFENCE asm volatile ("sfence" ::: "memory")
+  #elif defined(PWB_IS_CLFLUSHOPT)
+    #define FLUSH(addr) asm volatile ("clflushopt (%0)" :: "r"(addr))
+    #define FLUSHFENCE asm volatile ("sfence" ::: "memory")
   #elif defined(PWB_IS_PCM)
     #define FLUSH(addr) emulate_latency_ns(340)
     #define FLUSHFENCE emulate_latency_ns(500)
   #else
-    #error "Please define what PWB is."
+    #define PWB_IS_RUNTIME
+    #define FLUSH(addr) pwb_runtime(addr)
+    #define FLUSHFENCE pfence_runtime()
   #endif /* PWB_IS_? */
 #else /* !DUR_LIN */
     #define FLUSH(addr) 
@@ -34,6 +34,15 @@ enum RegionIndex : int {
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
 
+// TLS_INITIAL_EXEC puts thread caches in the initial-exec TLS model, which
+// saves a __tls_get_addr call per access in -fPIC code. Only for libralloc
+// linked statically or loaded at startup, i.e., not dlopen()ed.
+#ifdef TLS_INITIAL_EXEC
+  #define RP_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+  #define RP_TLS_MODEL
+#endif
+
 // returns smallest value >= value with alignment align
 #define ALIGN_VAL(val, align) \
     ( __typeof__ (val))(((uint64_t)(val) + (align - 1)) & ((~(align)) + 1))
@@ -65,9 +74,70 @@ enum RegionIndex : int {
 
 /* Customizable Values */
 const uint64_t MAX_DESC_AMOUNT_BITS = 24;
-const uint64_t MIN_SB_REGION_SIZE = 1*1024*1024*1024ULL; // min sb region size
-const uint64_t SB_REGION_EXPAND_SIZE = MIN_SB_REGION_SIZE;
+const uint64_t MIN_SB_REGION_SIZE = 1*1024*1024*1024ULL; // min initial sb region size; it grows on demand
 const int MAX_ROOTS = 1024;
+// default bounds (in blocks) of the adaptive capacity of a thread cache bin;
+// both are clamped to the number of blocks in a superblock of the size class
+const uint32_t TCACHE_MIN_BLOCKS = 32;
+const uint32_t TCACHE_MAX_BLOCKS = 2048;
+// default percentage of capacity a bin is filled to when it runs empty; fill
+// pulls from as many partial superblocks as needed to reach it
+const uint32_t TCACHE_FILL_PCT = 100;
+// default percentage of capacity kept by a bin when it overflows; the rest,
+// i.e. the least recently freed blocks, is flushed
+const uint32_t TCACHE_FLUSH_KEEP_PCT = 50;
+// overflows without a fill in between before a bin halves its capacity
+const uint32_t TCACHE_MAX_OVERFLOWS = 3;
+// cache slow path events between two decay steps, each visiting one bin
+const uint32_t TCACHE_DECAY_INTERVAL = 64;
+// slots of the on-stack table grouping blocks by superblock in flush; must be
+// a power of 2, and at most 3/4 of it are used before giving groups back
+const uint32_t FLUSH_GROUP_SLOTS = 128;
+// default of whether frees of blocks owned by another thread are batched and
+// handed over to that thread, instead of going through the local cache
+const bool REMOTE_FREE = false;
+// max number of threads owning a remote free slot at the same time; threads
+// beyond that fall back to the local cache path
+const uint32_t REMOTE_SLOTS = 1024;
+// per-thread batches of pending remote frees; must be a power of 2
+const uint32_t REMOTE_BATCHES = 16;
+// blocks in a remote free batch before it's handed over
+const uint32_t REMOTE_BATCH_BLOCKS = 64;
+// interval of the background trimmer draining caches of threads idle for a
+// whole interval; 0 disables it
+const uint32_t TRIM_INTERVAL_MS = 0;
+// max number of shards of the free superblock list
+const uint32_t MAX_SB_SHARDS = 64;
+// default number of shards of the free superblock list, each used by threads
+// running on CPUs with the same index modulo it; 0 means one per online CPU
+// (up to MAX_SB_SHARDS), and 1 is a single global list
+const uint32_t SB_SHARDS = 0;
+// default number of empty superblocks kept committed; superblocks retired
+// beyond that are punched out of the heap file. 0 never punches
+const uint32_t SB_DECOMMIT_WATERMARK = 4096;
+// max number of superblocks moved at once from free extents to an empty
+// superblock shard
+const uint64_t SB_EXTENT_BATCH = 64;
+// a small size class takes a span of superblocks rather than one if the
+// tail one leaves is over 1/SB_TAIL_WASTE_DIV of it
+const uint64_t SB_TAIL_WASTE_DIV = 32;
+// default MB of sb region beyond its frontier kept populated, with the descs
+// of those sbs, by a background prefaulter; 0 disables it
+const uint32_t PREFAULT_MB = 0;
+// interval the prefaulter checks the frontier at, unless it's woken up
+// earlier by a frontier closing in
+const uint32_t PREFAULT_INTERVAL_MS = 10;
+// size from which persist_memset and persist_memcpy take non-temporal stores
+const size_t NT_STORE_THRESHOLD = 256;
+// default flush instruction, PWB_KIND_*; PWB_KIND_NONE takes the fastest one
+// the CPU has. Only for builds choosing it at runtime, see pfence_util.h
+const uint8_t PWB = PWB_KIND_NONE;
+// default number of threads writing back the heap at exit; 0 means one per
+// online CPU
+const uint32_t WRITEBACK_THREADS = 0;
+// default last size served by size classes, from MAX_SMALL_SZ to MAX_SZ;
+// larger ones are rounded up to superblocks
+const uint32_t SC_MAX_SIZE = (1 << 18);
 
 /* System Macros */
 const int TYPE_SIZE = 4;
@@ -82,15 +152,21 @@ const uint64_t PAGE_MASK = (uint64_t)PAGESIZE - 1;
 const int LARGE = 249; // tag indicating the block is large
 const int SMALL = 250; // tag indicating the block is small
 // number of size classes; idx 0 reserved for large size classes
-const int MAX_SZ_IDX = 40;
+const int MAX_SZ_IDX = 57;
 const uint64_t SC_MASK = (1ULL << 6) - 1;
-// last size covered by a size class
-// allocations with size > MAX_SZ are not covered by a size class
-const int MAX_SZ = ((1 << 13) + (1 << 11) * 3);
+// last size covered by a small size class, whose blocks are in a superblock
+const int MAX_SMALL_SZ = ((1 << 13) + (1 << 11) * 3);
+// last size covered by a (medium) size class, whose blocks are in a span of
+// superblocks; allocations with size > MAX_SZ are not covered by a size class
+const int MAX_SZ = (1 << 18);
 const uint64_t SBSIZE = (16 * PAGESIZE); // size of a superblock 64K
 const uint64_t DESCSIZE = CACHELINE_SIZE;
 const int SB_SHIFT = 16; // assume size of a superblock is 64K
 const int DESC_SHIFT = 6; // assume size of a descriptor is 64B
+const uint64_t HUGEPAGE_SIZE = 2*1024*1024ULL; // size of a PMD mapping 2M
+// alignment of region bases, so sbs stay aligned to SBSIZE across restarts,
+// and the regions can be mapped by huge pages
+const uint64_t REGION_ALIGN = HUGEPAGE_SIZE;
 
 
 /* Consts Determined by Customizable Values */
@@ -12,6 +12,7 @@
 #include <vector>
 #include <algorithm>
 #include <cstring>
+#include <unistd.h>
 
 #include "RegionManager.hpp"
 #include "BaseMeta.hpp"
@@ -25,19 +26,65 @@ namespace ralloc{
     /* persistent metadata and their layout */
     BaseMeta* base_md;
     Regions* _rgs;
+    // page size sb region is mapped by, found at init
+    uint64_t sb_page_size = PAGESIZE;
+    // flush instruction chosen at init
+    uint8_t pwb_in_use = PWB_KIND_NONE;
+    uint32_t writeback_thread_num = 1;
     std::function<void(const CrossPtr<char, SB_IDX>&, GarbageCollection&)> roots_filter_func[MAX_ROOTS];
     extern SizeClass sizeclass;
 };
 using namespace ralloc;
 extern void public_flush_cache();
 
-int _RP_init(const char* _id, uint64_t size){
+int _RP_init(const char* _id, uint64_t size, const RP_config* cfg){
     string filepath;
     string id(_id);
     // thread_num = thd_num;
+    RP_config config;
+    if(cfg == nullptr){
+        RP_config_default(&config);
+    } else {
+        config = *cfg;
+    }
 
     // reinitialize global variables in case they haven't
     new (&sizeclass) SizeClass();
+    sizeclass.set_cache_bounds(config.tcache_min_blocks, config.tcache_max_blocks);
+    sizeclass.set_fill(config.tcache_fill_pct);
+    sizeclass.set_flush_keep(config.tcache_flush_keep_pct);
+    remote_free = config.remote_free != 0;
+    sb_shard_num = config.sb_shards;
+    if(sb_shard_num == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        sb_shard_num = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    sb_shard_num = min(sb_shard_num, MAX_SB_SHARDS);
+    sb_decommit_watermark = config.sb_decommit_watermark;
+    sc_max_size = max(min(config.sc_max_size, (uint32_t)MAX_SZ), (uint32_t)MAX_SMALL_SZ);
+    writeback_thread_num = config.writeback_threads;
+    if(writeback_thread_num == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        writeback_thread_num = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    sb_dirty.init(MAX_SB_AMOUNT);
+    const char* pwb_env = getenv("RALLOC_PWB");
+    if(pwb_env != nullptr){
+        config.pwb = PWB_KIND_NONE;
+        for(uint8_t k = PWB_KIND_CLFLUSH; k <= PWB_KIND_LAST; k++)
+            if(strcmp(pwb_env, pwb_name(k)) == 0)
+                config.pwb = k;
+        if(config.pwb == PWB_KIND_NONE)
+            printf("Warning: RALLOC_PWB=%s is no flush instruction, taking the fastest one\n", pwb_env);
+    }
+    // before anything is flushed
+    pwb_in_use = pwb_select((uint8_t)config.pwb);
+#ifdef PWB_IS_RUNTIME
+    if(config.pwb != PWB_KIND_NONE && pwb_in_use != config.pwb)
+        printf("Warning: CPU lacks %s, flushing by %s\n",
+            pwb_name(config.pwb), pwb_name(pwb_in_use));
+#endif
+    DBG_PRINT("flush by %s\n", pwb_name(pwb_in_use));
 
     filepath = HEAPFILE_PREFIX + id;
     assert(sizeof(Descriptor) == DESCSIZE); // check desc size
@@ -48,32 +95,61 @@ int _RP_init(const char* _id, uint64_t size){
     for(int i=0; i<LAST_IDX;i++){
     switch(i){
     case DESC_IDX:
-        _rgs->create(filepath+"_desc", num_sb*DESCSIZE, true, true);
+        _rgs->create(filepath+"_desc", num_sb*DESCSIZE, true, true, MAX_DESC_REGION_SIZE);
         break;
     case SB_IDX:
-        _rgs->create(filepath+"_sb", num_sb*SBSIZE, true, false);
+        _rgs->create(filepath+"_sb", num_sb*SBSIZE, true, false, MAX_SB_REGION_SIZE);
         break;
     case META_IDX:
         base_md = _rgs->create_for<BaseMeta>(filepath+"_basemd", sizeof(BaseMeta), true);
         break;
     } // switch
     }
+    sb_page_size = _rgs->regions[SB_IDX]->__page_size();
+    DBG_PRINT("sb region is mapped by %lu KB pages\n", sb_page_size/1024);
+    if(restart){
+        if(base_md->layout != BASEMETA_LAYOUT){
+            fprintf(stderr, "Heap %s has layout %lx, but this Ralloc reads %lx; "
+                "it was created by another version\n",
+                filepath.c_str(), base_md->layout, BASEMETA_LAYOUT);
+            exit(1);
+        }
+        // a crash may come between growing sb region and desc region
+        base_md->extend_descs(_rgs->regions[SB_IDX]->curr_addr_ptr->load());
+        base_md->load_extents();
+        base_md->fold_sb_shards();
+        base_md->mark_used_sbs();
+    }
     initialized = true;
+    if(config.trim_interval_ms != 0){
+        start_trimmer(config.trim_interval_ms);
+    }
+    if(config.prefault_mb != 0){
+        start_prefaulter((uint64_t)config.prefault_mb*1024*1024);
+    }
     return (int)restart;
 }
 
 struct RallocHolder{
     int init_ret_val;
-    RallocHolder(const char* _id, uint64_t size){
-        init_ret_val = _RP_init(_id,size);
+    RallocHolder(const char* _id, uint64_t size, const RP_config* cfg){
+        init_ret_val = _RP_init(_id,size,cfg);
     }
     ~RallocHolder(){
+        // trimmer touches caches and heap, so stop it first
+        stop_trimmer();
+        stop_prefaulter();
+        // blocks freed to exited threads are still in their slots
+        base_md->remote_drain_orphans();
         // #ifndef MEM_CONSUME_TEST
         // flush_region would affect the memory consumption result (rss) and 
         // thus is disabled for benchmark testing. To enable, simply comment out
         // -DMEM_CONSUME_TEST flag in Makefile.
-        _rgs->flush_region(DESC_IDX);
-        _rgs->flush_region(SB_IDX);
+        // Only sbs used since start are written back now, so those punched
+        // out or never touched aren't faulted in.
+        uint64_t flushed = base_md->flush_heap(writeback_thread_num);
+        DBG_PRINT("%lu bytes written back by %u threads", flushed, writeback_thread_num);
+        (void)flushed;
         // #endif
         base_md->writeback();
         initialized = false;
@@ -88,10 +164,52 @@ struct RallocHolder{
  * id is the distinguishable identity of applications.
  */
 int RP_init(const char* _id, uint64_t size){
-    static RallocHolder _holder(_id,size);
+    return RP_init_config(_id, size, nullptr);
+}
+
+int RP_init_config(const char* _id, uint64_t size, const RP_config* cfg){
+    static RallocHolder _holder(_id,size,cfg);
     return _holder.init_ret_val;
 }
 
+void RP_config_default(RP_config* cfg){
+    cfg->tcache_min_blocks = TCACHE_MIN_BLOCKS;
+    cfg->tcache_max_blocks = TCACHE_MAX_BLOCKS;
+    cfg->tcache_fill_pct = TCACHE_FILL_PCT;
+    cfg->tcache_flush_keep_pct = TCACHE_FLUSH_KEEP_PCT;
+    cfg->remote_free = REMOTE_FREE;
+    cfg->trim_interval_ms = TRIM_INTERVAL_MS;
+    cfg->sb_shards = SB_SHARDS;
+    cfg->sb_decommit_watermark = SB_DECOMMIT_WATERMARK;
+    cfg->sc_max_size = SC_MAX_SIZE;
+    cfg->prefault_mb = PREFAULT_MB;
+    cfg->pwb = PWB;
+    cfg->writeback_threads = WRITEBACK_THREADS;
+}
+
+void RP_get_stats(RP_stats* stats){
+    for(int i=0;i<MAX_SZ_IDX;i++){
+        stats->tcache_limit[i] = t_caches.t_cache[i].get_limit();
+        stats->tcache_blocks[i] = t_caches.t_cache[i].get_block_num();
+    }
+    stats->tcache_fills = counters.cache_fills.load();
+    stats->tcache_full_flushes = counters.cache_full_flushes.load();
+    stats->tcache_partial_flushes = counters.cache_partial_flushes.load();
+    stats->remote_batches = counters.remote_batches.load();
+    stats->remote_adopted = counters.remote_adopted.load();
+    stats->trimmer_drains = counters.trimmer_drains.load();
+    stats->sb_steals = counters.sb_steals.load();
+    stats->sb_decommits = counters.sb_decommits.load();
+    base_md->sb_usage(&stats->sb_logical_bytes, &stats->sb_resident_bytes);
+    stats->free_extent_bytes = free_extents.total();
+    stats->prefault_bytes = counters.prefault_bytes.load();
+    stats->sb_file_bytes = _rgs->regions[SB_IDX]->FILESIZE.load();
+    stats->sb_page_size = sb_page_size;
+    stats->pwb = pwb_in_use;
+    stats->fences_saved = counters.fences_saved.load();
+    stats->flushes_saved = counters.flushes_saved.load();
+}
+
 int RP_recover(){
     return (int) base_md->restart();
 }
@@ -103,14 +221,33 @@ void RP_close(){
 
 void* RP_malloc(size_t sz){
     assert(initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
     return base_md->do_malloc(sz);
 }
 
 void RP_free(void* ptr){
     assert(initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
     base_md->do_free(ptr);
 }
 
+void RP_free_sized(void* ptr, size_t size){
+    assert(initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
+    base_md->do_free_sized(ptr, size);
+}
+
+void RP_thread_cache_trim(int level){
+    assert(initialized&&"RPMalloc isn't initialized!");
+    assert(level >= RP_TRIM_IDLE && level <= RP_TRIM_ALL);
+    TCacheGuard guard;
+    base_md->trim_cache(&t_caches, level);
+}
+
+void RP_thread_cache_flush(){
+    RP_thread_cache_trim(RP_TRIM_ALL);
+}
+
 void* RP_set_root(void* ptr, uint64_t i){
     if(ralloc::initialized==false){
         RP_init("no_explicit_init");
@@ -138,20 +275,21 @@ void* RP_realloc(void* ptr, size_t new_size){
     }
     void* new_ptr = RP_malloc(new_size);
     if(UNLIKELY(new_ptr == nullptr)) return nullptr;
-    memcpy(new_ptr, ptr, old_size);
-    FLUSH(new_ptr);
-    FLUSHFENCE;
+    // a smaller new block takes only what fits
+    persist_memcpy(new_ptr, ptr, min(old_size, new_size));
     RP_free(ptr);
     return new_ptr;
 }
 
 void* RP_calloc(size_t num, size_t size){
-    void* ptr = RP_malloc(num*size);
+    assert(initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
+    // a large block of sbs punched out or never used reads zero already
+    bool zeroed = false;
+    void* ptr = base_md->do_malloc(num*size, &zeroed);
     if(UNLIKELY(ptr == nullptr)) return nullptr;
-    size_t real_size = RP_malloc_size(ptr);
-    memset(ptr, 0, real_size);
-    FLUSH(ptr);
-    FLUSHFENCE;
+    if(!zeroed)
+        persist_memset(ptr, 0, RP_malloc_size(ptr));
     return ptr;
 }
 
@@ -10,10 +10,120 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* number of size classes, including the reserved class 0 for large blocks */
+#define RP_SIZE_CLASS_NUM 57
+
+/*
+ * Runtime tunables of Ralloc, taken by RP_init_config().
+ * Fill it by RP_config_default() and then override fields you care about.
+ */
+typedef struct RP_config{
+    /* bounds (in blocks) of the adaptive capacity of each thread cache bin */
+    uint32_t tcache_min_blocks;
+    uint32_t tcache_max_blocks;
+    /* percentage of capacity an empty bin is refilled to */
+    uint32_t tcache_fill_pct;
+    /* percentage of capacity an overflowing bin keeps; 0 drains the bin */
+    uint32_t tcache_flush_keep_pct;
+    /* nonzero to batch frees of blocks owned by other threads and hand them
+     * over to their owners */
+    uint32_t remote_free;
+    /* interval of the background trimmer in ms; it drains caches of threads
+     * that made no Ralloc call for a whole interval. 0 disables it */
+    uint32_t trim_interval_ms;
+    /* shards of the free superblock list, picked by CPU of the caller;
+     * 0 means one per online CPU, 1 is a single global list */
+    uint32_t sb_shards;
+    /* empty superblocks kept committed; those retired beyond it are punched
+     * out of the heap file. 0 never punches */
+    uint32_t sb_decommit_watermark;
+    /* last size served by size classes, clamped to the small classes up to
+     * 14KB at least and to medium classes up to 256KB at most; larger sizes
+     * take whole superblocks */
+    uint32_t sc_max_size;
+    /* MB of heap beyond what's ever been allocated that a background thread
+     * keeps populated, so that first touches to it take no page fault.
+     * 0 disables it */
+    uint32_t prefault_mb;
+    /* flush instruction, RP_PWB_*; RP_PWB_AUTO or one the CPU lacks takes
+     * the fastest one it has. Environment variable RALLOC_PWB, e.g.,
+     * RALLOC_PWB=clflushopt, overrides it. Ignored by builds with PWB_IS_* */
+    uint32_t pwb;
+    /* threads writing back the heap at exit, which skips superblocks
+     * unused since start; 0 means one per online CPU */
+    uint32_t writeback_threads;
+} RP_config;
+
+/* flush instructions for RP_config.pwb */
+#define RP_PWB_AUTO 0
+#define RP_PWB_CLFLUSH 1
+#define RP_PWB_CLWB 2
+#define RP_PWB_CLFLUSHOPT 3
+
+/* levels of RP_thread_cache_trim() */
+/* shrink bins idle since the last trim or decay round */
+#define RP_TRIM_IDLE 0
+/* shrink all bins to their min capacity */
+#define RP_TRIM_MIN 1
+/* flush all cached blocks, pending remote frees, and blocks other threads
+ * freed to the caller */
+#define RP_TRIM_ALL 2
+
+/* 
+ * Snapshot taken by RP_get_stats(). Counters are summed over all threads
+ * while tcache_* arrays are of the calling thread only.
+ */
+typedef struct RP_stats{
+    /* current capacity and number of cached blocks of each size class */
+    uint32_t tcache_limit[RP_SIZE_CLASS_NUM];
+    uint32_t tcache_blocks[RP_SIZE_CLASS_NUM];
+    /* thread cache refills */
+    uint64_t tcache_fills;
+    /* flushes draining a whole bin, and those keeping its hot blocks */
+    uint64_t tcache_full_flushes;
+    uint64_t tcache_partial_flushes;
+    /* remote free batches handed over, and blocks adopted from them */
+    uint64_t remote_batches;
+    uint64_t remote_adopted;
+    /* caches of idle threads drained by the background trimmer */
+    uint64_t trimmer_drains;
+    /* free superblocks taken from the shard of another CPU */
+    uint64_t sb_steals;
+    /* empty superblocks punched out of the heap file */
+    uint64_t sb_decommits;
+    /* bytes of superblock region in use, and how many of them are resident,
+     * i.e., touched and not punched out since */
+    uint64_t sb_logical_bytes;
+    uint64_t sb_resident_bytes;
+    /* bytes in free extents reusable by large blocks */
+    uint64_t free_extent_bytes;
+    /* bytes of heap and metadata populated by the prefaulter */
+    uint64_t prefault_bytes;
+    /* size of the superblock region file, which grows on demand */
+    uint64_t sb_file_bytes;
+    /* page size the superblock region is mapped by, e.g., 2MB if its first
+     * 2MB got a huge page at init */
+    uint64_t sb_page_size;
+    /* flush instruction in use, RP_PWB_*; RP_PWB_AUTO if it flushes nothing */
+    uint32_t pwb;
+    /* fences and flushes the slow paths reworked to persist in batches
+     * no longer issue, over what they issued before */
+    uint64_t fences_saved;
+    uint64_t flushes_saved;
+} RP_stats;
+
 #ifdef __cplusplus
 /* return 1 if it's a restart, otherwise 0. */
 extern "C" int RP_init(const char* _id, uint64_t size = 5*1024*1024*1024ULL);
+/* same as RP_init, with tunables in cfg; nullptr means default. */
+extern "C" int RP_init_config(const char* _id, uint64_t size, const RP_config* cfg);
 #include "BaseMeta.hpp"
+static_assert(RP_SIZE_CLASS_NUM == MAX_SZ_IDX, "RP_SIZE_CLASS_NUM mismatches MAX_SZ_IDX");
+static_assert(RP_TRIM_IDLE == TRIM_IDLE && RP_TRIM_MIN == TRIM_MIN &&
+    RP_TRIM_ALL == TRIM_ALL, "RP_TRIM_* mismatches TrimLevel");
+static_assert(RP_PWB_AUTO == PWB_KIND_NONE && RP_PWB_CLFLUSH == PWB_KIND_CLFLUSH &&
+    RP_PWB_CLWB == PWB_KIND_CLWB && RP_PWB_CLFLUSHOPT == PWB_KIND_CLFLUSHOPT,
+    "RP_PWB_* mismatches PwbKind");
 namespace ralloc{
     extern bool initialized;
     /* persistent metadata and their layout */
@@ -24,19 +134,93 @@ T* RP_get_root(uint64_t i){
     assert(ralloc::initialized);
     return ralloc::base_md->get_root<T>(i);
 }
+
+/*
+ * Inline versions of RP_malloc and RP_free for C++. They pop from or push to
+ * the thread cache directly, and only call into the library when the bin is
+ * empty or full, the size is large, or remote free is enabled.
+ */
+inline void* RP_malloc_fast(size_t sz){
+    assert(ralloc::initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
+    if(LIKELY(sz <= ralloc::sc_max_size)){
+        TCacheBin* cache = &ralloc::t_caches.t_cache[SizeClass::get_sizeclass(sz)];
+        if(LIKELY(cache->get_block_num() != 0))
+            return cache->pop_block();
+    }
+    return ralloc::base_md->do_malloc(sz);
+}
+inline void RP_free_fast(void* ptr){
+    assert(ralloc::initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
+    if(LIKELY(ptr != nullptr && !ralloc::remote_free)){
+        size_t sc_idx = ralloc::base_md->desc_lookup(ptr)->sc_idx;
+        // sc 0 is for large blocks
+        if(LIKELY(sc_idx != 0)){
+            TCacheBin* cache = &ralloc::t_caches.t_cache[sc_idx];
+            if(LIKELY(cache->get_block_num() < cache->get_limit())){
+                cache->push_block((char*)ptr);
+                return;
+            }
+        }
+    }
+    ralloc::base_md->do_free(ptr);
+}
+/*
+ * inline version of RP_free_sized; no descriptor lookup for sizes up to
+ * MAX_SMALL_SZ unless DEBUG
+ */
+inline void RP_free_sized_fast(void* ptr, size_t size){
+    assert(ralloc::initialized&&"RPMalloc isn't initialized!");
+    TCacheGuard guard;
+    if(LIKELY(ptr != nullptr && size <= MAX_SMALL_SZ && !ralloc::remote_free)){
+        size_t sc_idx = SizeClass::get_sizeclass(size);
+#ifdef DEBUG
+        assert(ralloc::base_md->desc_lookup(ptr)->sc_idx == sc_idx && "size mismatches block!");
+#endif
+        TCacheBin* cache = &ralloc::t_caches.t_cache[sc_idx];
+        if(LIKELY(cache->get_block_num() < cache->get_limit())){
+            cache->push_block((char*)ptr);
+            return;
+        }
+    }
+    ralloc::base_md->do_free_sized(ptr, size);
+}
+
+/*
+ * Deriving a class from RP_sized_delete makes new and delete of it go to
+ * Ralloc, and delete passes the object size to RP_free_sized. Objects
+ * deleted through a pointer to a base class need a virtual destructor so
+ * that the right size is passed; DEBUG checks it.
+ */
+struct RP_sized_delete{
+    static void* operator new(size_t sz){ return RP_malloc_fast(sz); }
+    static void* operator new[](size_t sz){ return RP_malloc_fast(sz); }
+    static void operator delete(void* ptr, size_t sz){ RP_free_sized_fast(ptr, sz); }
+    static void operator delete[](void* ptr, size_t sz){ RP_free_sized_fast(ptr, sz); }
+};
 extern "C"{
 #else /* __cplusplus ends */
 // This is a version for pure c only
 void* RP_get_root_c(uint64_t i);
 /* return 1 if it's a restart, otherwise 0. */
 int RP_init(const char* _id, uint64_t size);
+int RP_init_config(const char* _id, uint64_t size, const RP_config* cfg);
 #endif
 
+void RP_config_default(RP_config* cfg);
+void RP_get_stats(RP_stats* stats);
 /* return 1 if it's dirty, otherwise 0. */
 int RP_recover();
 void RP_close();
 void* RP_malloc(size_t sz);
 void RP_free(void* ptr);
+/* free ptr allocated by RP_malloc(size); skips the descriptor of small blocks */
+void RP_free_sized(void* ptr, size_t size);
+/* give back blocks cached by the calling thread; level is RP_TRIM_* */
+void RP_thread_cache_trim(int level);
+/* same as RP_thread_cache_trim(RP_TRIM_ALL), e.g., before a thread idles */
+void RP_thread_cache_flush();
 void* RP_set_root(void* ptr, uint64_t i);
 size_t RP_malloc_size(void* ptr);
 void* RP_calloc(size_t num, size_t size);
@@ -59,6 +243,7 @@ int RP_region_range(int idx, void** start_addr, void** end_addr);
  * 			Construct the singleton with id to decide where the data 
  * 			maps to. If the file exists, it tries to restart; otherwise,
  * 			it starts from scratch.
+ * 			RP_init_config() does the same with tunables in RP_config.
  * 		_close():
  * 			Shutdown the allocator by cleaning up free list 
  * 			and RegionManager pointer, but BaseMeta data will
@@ -59,8 +59,8 @@ volatile static int init_count = 0;
 #ifdef RALLOC
 
   #include "ralloc.hpp"
-  inline void* pm_malloc(size_t s) { return RP_malloc(s); }
-  inline void pm_free(void* p) { RP_free(p); }
+  inline void* pm_malloc(size_t s) { return RP_malloc_fast(s); }
+  inline void pm_free(void* p) { RP_free_fast(p); }
   inline void* pm_realloc(void* ptr, size_t new_size) { return RP_realloc(ptr, new_size); }
   inline void* pm_calloc(size_t num, size_t size) { return RP_calloc(num, size); }
   inline int pm_init() { return RP_init("test", REGION_SIZE); }
@@ -215,6 +215,11 @@ int main (int argc, char *argv[])
 
 #ifdef _DEBUG
   _cputs("Hit any key to exit...") ;	(void)_getch() ;
+#endif
+#ifdef RALLOC
+  RP_stats stats;
+  RP_get_stats(&stats);
+  printf ("Flush instruction = %s\n", pwb_name(stats.pwb));
 #endif
   pm_close();
   return(0) ;
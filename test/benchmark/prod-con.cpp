@@ -11,6 +11,10 @@
  * The benchmark is designed per the description of prod-con in the paper:
  *    Makalu: Fast Recoverable Allocation of Non-volatile Memory
  *    K. Bhandari et al.
+ *
+ * Optional 4th argument remoteFree (Ralloc only): 1 makes consumers hand the
+ * freed objects back to producers in batches (RP_config::remote_free), 0
+ * frees them to consumers' own caches. Default follows RP_config_default().
  */
 
 #include <stdio.h>
@@ -139,17 +143,20 @@ int main (int argc, char * argv[]){
 	int nthreads;
 	int objNum = 10000000;
 	int objSize = 64; // byte
+	int remoteFree = -1; // allocator default
 
 	if (argc > 3) {
 		nthreads = atoi(argv[1]);
 		objNum = atoi(argv[2]);
 		objSize = atoi(argv[3]);
+		if (argc > 4)
+			remoteFree = atoi(argv[4]);
 		if(nthreads%2!=0) {
 			fprintf (stderr, "nthreads must be even\n");
 			return 1;
 		}
 	} else {
-		fprintf (stderr, "Usage: %s nthreads objNum objSize\n", argv[0]);
+		fprintf (stderr, "Usage: %s nthreads objNum objSize [remoteFree]\n", argv[0]);
 		return 1;
 	}
 	pthread_barrier_init(&barrier,NULL,nthreads);
@@ -164,6 +171,15 @@ int main (int argc, char * argv[]){
 		wArg.emplace_back(msqs[i], objNum*2/nthreads, objSize, i);
 	}
 
+#ifdef RALLOC
+	if (remoteFree >= 0) {
+		// RP_init in pm_init() is a noop once the heap is initialized
+		RP_config cfg;
+		RP_config_default(&cfg);
+		cfg.remote_free = remoteFree;
+		RP_init_config("test", REGION_SIZE, &cfg);
+	}
+#endif
 	pm_init();
 	HL::Timer t;
 	t.start();
@@ -183,6 +199,13 @@ int main (int argc, char * argv[]){
 	}
 	delete [] threads;
 	printf ("Time elapsed = %f seconds.\n", (double) t);
+#ifdef RALLOC
+	RP_stats stats;
+	RP_get_stats(&stats);
+	printf ("Remote free batches = %lu, adopted blocks = %lu\n",
+		(unsigned long)stats.remote_batches, (unsigned long)stats.remote_adopted);
+	printf ("Flush instruction = %s\n", pwb_name(stats.pwb));
+#endif
 
 	pm_close();
 	return 0;
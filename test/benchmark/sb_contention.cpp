@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+/*
+ * This is a microbenchmark of contention on the free superblock list.
+ *
+ * Each thread repeatedly allocates a batch of blocks of the largest small
+ * size class and frees them all. Blocks of that class are so large that a
+ * superblock only holds a few and thread cache bins are clamped to that, so
+ * almost every superblock is taken from the free superblock list and retired
+ * back to it within a round. Run it once with shards=1, i.e. the single
+ * global list, and once with shards=0, i.e. one shard per online CPU, to
+ * compare the two designs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include "ralloc.hpp"
+
+static void worker(int rounds, int blocks){
+	std::vector<void*> ptrs(blocks);
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < blocks; i++)
+			ptrs[i] = RP_malloc(MAX_SMALL_SZ);
+		for (int i = 0; i < blocks; i++)
+			RP_free(ptrs[i]);
+	}
+}
+
+int main (int argc, char * argv[]){
+	int nthreads = 8;
+	int rounds = 1000;
+	int blocks = 256; // per round per thread
+	int shards = 0; // 0: one per CPU
+
+	if (argc > 4) {
+		nthreads = atoi(argv[1]);
+		rounds = atoi(argv[2]);
+		blocks = atoi(argv[3]);
+		shards = atoi(argv[4]);
+	} else {
+		fprintf (stderr, "Usage: %s nthreads rounds blocks shards\n", argv[0]);
+		fprintf (stderr, "Using default: %d %d %d %d\n", nthreads, rounds, blocks, shards);
+	}
+
+	RP_config cfg;
+	RP_config_default(&cfg);
+	cfg.sb_shards = shards;
+	RP_init_config("test", 2*1024*1024*1024ULL, &cfg);
+
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nthreads; i++)
+		threads.emplace_back(worker, rounds, blocks);
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	RP_stats stats;
+	RP_get_stats(&stats);
+	printf ("Shards = %u\n", ralloc::sb_shard_num);
+	printf ("Time elapsed = %f\n", elapsed.count());
+	printf ("Superblocks stolen = %lu\n", (unsigned long)stats.sb_steals);
+	RP_close();
+	return 0;
+}
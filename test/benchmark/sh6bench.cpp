@@ -185,6 +185,11 @@ int main(int argc, char *argv[])
 			  elapsedTime, cpuTime);
 
 	fprintf(fout, "\nrdtsc time: %f\n", ((double)end_ - (double)start_)/kCPUSpeed);
+#ifdef RALLOC
+	RP_stats stats;
+	RP_get_stats(&stats);
+	fprintf(fout, "Flush instruction = %s\n", pwb_name(stats.pwb));
+#endif
 
 	if (fin != stdin)
 		fclose(fin);
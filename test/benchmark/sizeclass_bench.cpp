@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+/*
+ * This is a microbenchmark of size to size class computation.
+ *
+ * It compares SizeClass::get_sizeclass against the size_t table indexed by
+ * size that Ralloc used before (MAX_SZ+1 entries, ~2MB). Each round looks
+ * up a batch of random sizes, optionally after streaming through a buffer of
+ * evictSize KB that plays the application's working set and pushes the table
+ * out of cache. As in malloc, where the size class is needed to find the
+ * cache bin, each lookup depends on the previous one so latency is measured
+ * rather than throughput. Both methods are checked to agree on every size
+ * first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+
+#include "SizeClass.hpp"
+
+// the old lookup table, built as SizeClass used to do
+static size_t old_lookup[MAX_SZ + 1];
+
+static void build_old_lookup(SizeClass& sc){
+	size_t lookupIdx = 0;
+	for (size_t sc_idx = 1; sc_idx < MAX_SZ_IDX; ++sc_idx) {
+		size_t block_size = sc.get_sizeclass_by_idx(sc_idx)->block_size;
+		while (lookupIdx <= block_size) {
+			old_lookup[lookupIdx] = sc_idx;
+			++lookupIdx;
+		}
+	}
+}
+
+// always 0, but unknown to the compiler; chains lookups one after another
+static volatile size_t zero = 0;
+
+static size_t evict(const volatile char* buf, size_t len){
+	size_t sum = 0;
+	for (size_t i = 0; i < len; i += 64)
+		sum += buf[i];
+	return sum;
+}
+
+int main (int argc, char * argv[]){
+	int rounds = 2000;
+	int batch = 4096; // lookups per round
+	int evictSize = 1024; // KB
+
+	if (argc > 3) {
+		rounds = atoi(argv[1]);
+		batch = atoi(argv[2]);
+		evictSize = atoi(argv[3]);
+	} else {
+		fprintf (stderr, "Usage: %s rounds batch evictSize(KB)\n", argv[0]);
+		fprintf (stderr, "Using default: %d %d %d\n", rounds, batch, evictSize);
+	}
+
+	SizeClass sc;
+	build_old_lookup(sc);
+	for (size_t s = 0; s <= (size_t)MAX_SZ; s++) {
+		if (sc.get_sizeclass(s) != old_lookup[s]) {
+			fprintf (stderr, "mismatch at size %zu: %zu vs %zu\n",
+				s, sc.get_sizeclass(s), old_lookup[s]);
+			return 1;
+		}
+	}
+	printf ("Size classes agree on sizes 0..%d\n", MAX_SZ);
+
+	std::vector<size_t> sizes(batch);
+	srand(0);
+	for (int i = 0; i < batch; i++)
+		sizes[i] = rand() % (MAX_SZ + 1);
+	size_t evictLen = (size_t)evictSize * 1024;
+	char* buf = (char*)malloc(evictLen > 0 ? evictLen : 1);
+	memset(buf, 0, evictLen > 0 ? evictLen : 1);
+
+	volatile size_t sink = 0;
+	size_t z = zero;
+	std::chrono::nanoseconds time_old(0), time_new(0);
+	for (int r = 0; r < rounds; r++) {
+		size_t sum = 0;
+
+		sum += evict(buf, evictLen);
+		auto start = std::chrono::steady_clock::now();
+		size_t idx = 0;
+		for (int i = 0; i < batch; i++) {
+			idx = old_lookup[sizes[i] + (idx & z)];
+			sum += idx;
+		}
+		time_old += std::chrono::steady_clock::now() - start;
+
+		sum += evict(buf, evictLen);
+		start = std::chrono::steady_clock::now();
+		idx = 0;
+		for (int i = 0; i < batch; i++) {
+			idx = sc.get_sizeclass(sizes[i] + (idx & z));
+			sum += idx;
+		}
+		time_new += std::chrono::steady_clock::now() - start;
+
+		sink += sum;
+	}
+	free(buf);
+
+	double lookups = (double)rounds * batch;
+	printf ("Table lookup: %f ns per size\n", time_old.count() / lookups);
+	printf ("Computed: %f ns per size\n", time_new.count() / lookups);
+	return 0;
+}
@@ -24,6 +24,12 @@
  * This program does nothing but generate a number of kernel threads
  * that allocate and free memory, with a variable
  * amount of "work" (i.e. cycle wasting) in between.
+ *
+ * With the optional 6th argument cold = 1, objects are only freed at the
+ * end, so every allocation comes from memory never used before, as in a
+ * young heap; the latency of each allocation is recorded and percentiles
+ * are printed. The optional 7th argument prefaultMB (Ralloc only) sets
+ * RP_config::prefault_mb; default follows RP_config_default().
 */
 
 #ifndef _REENTRANT
@@ -31,6 +37,9 @@
 #endif
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 #include <assert.h>
 #include <stdio.h>
@@ -45,6 +54,9 @@ int nobjects = 30000;  // Default number of objects.
 int nthreads = 1;	// Default number of threads.
 int work = 0;		// Default number of loop iterations.
 int sz = 1;
+int cold = 0;		// Free objects only at the end and record latencies.
+int prefaultMB = -1;	// Ralloc only; -1 follows the default.
+std::vector<std::vector<long> > latencies; // per thread, in ns, if cold
 
 
 class Foo {
@@ -109,6 +121,25 @@ extern "C" void * worker (void * arg)
 #endif
   int i, j;
   Foo ** a;
+  if (cold) {
+    // allocate everything before freeing anything
+    int n = (nobjects / nthreads) * niterations;
+    std::vector<long>& lat = latencies[*(int*)arg];
+    lat.reserve(n);
+    a = new Foo * [n];
+    for (i = 0; i < n; i++) {
+      auto start = std::chrono::steady_clock::now();
+      a[i] = new Foo[sz];
+      auto stop = std::chrono::steady_clock::now();
+      lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+      assert (a[i]);
+    }
+    for (i = 0; i < n; i++) {
+      delete[] a[i];
+    }
+    delete [] a;
+    return NULL;
+  }
   a = new Foo * [nobjects / nthreads];
   for (j = 0; j < niterations; j++) {
 
@@ -170,7 +201,25 @@ int main (int argc, char * argv[])
   if (argc >= 6) {
     sz = atoi(argv[5]);
   }
+
+  if (argc >= 7) {
+    cold = atoi(argv[6]);
+  }
+
+  if (argc >= 8) {
+    prefaultMB = atoi(argv[7]);
+  }
+#ifdef RALLOC
+  if (prefaultMB >= 0) {
+    // RP_init in pm_init() is a noop once the heap is initialized
+    RP_config cfg;
+    RP_config_default(&cfg);
+    cfg.prefault_mb = prefaultMB;
+    RP_init_config("test", REGION_SIZE, &cfg);
+  }
+#endif
   pm_init();
+  latencies.resize(nthreads);
 
   printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work and %d sz...\n", nthreads, niterations, nobjects, work, sz);
 
@@ -196,6 +245,27 @@ int main (int argc, char * argv[])
   t.stop ();
 
   printf( "Time elapsed = %f\n", (double) t);
+  if (cold) {
+    std::vector<long> all;
+    for (i = 0; i < nthreads; i++)
+      all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    std::sort(all.begin(), all.end());
+    if (!all.empty()) {
+      size_t n = all.size();
+      printf ("Allocation latency (ns): p50 = %ld, p99 = %ld, p99.9 = %ld, max = %ld\n",
+	      all[n / 2], all[n * 99 / 100], all[n * 999 / 1000], all[n - 1]);
+    }
+  }
+#ifdef RALLOC
+  RP_stats stats;
+  RP_get_stats(&stats);
+  if (stats.prefault_bytes != 0)
+    printf ("Prefaulted bytes = %lu\n", (unsigned long)stats.prefault_bytes);
+  printf ("Superblock page size = %lu KB\n", (unsigned long)stats.sb_page_size/1024);
+  printf ("Flush instruction = %s\n", pwb_name(stats.pwb));
+  printf ("Fences saved = %lu, flushes saved = %lu\n",
+	  (unsigned long)stats.fences_saved, (unsigned long)stats.flushes_saved);
+#endif
 
   delete [] threads;
   pm_close();
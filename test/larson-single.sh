@@ -33,5 +33,8 @@ while read line; do
   fi
 done < /tmp/larson
 
+# flush instruction Ralloc actually used, none for other allocators
+pwb=$(grep "Flush instruction" /tmp/larson | awk '{print $4}')
+
 echo "{ \"threads\": $THREADS , \"ops\":  $ops , \"allocator\": $ALLOC}"
-echo "$THREADS,$ops,$ALLOC" >> larson.csv
+echo "$THREADS,$ops,$ALLOC,${pwb:-none}" >> larson.csv
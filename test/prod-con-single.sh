@@ -1,7 +1,7 @@
 #!/bin/bash
 
 if [[ $# -lt 1 ]]; then
-  echo "usage: prod-con-single.sh <even num threads>"
+  echo "usage: prod-con-single.sh <even num threads> [alloc] [remote free 0|1]"
   echo ""
   echo "wraps a single run of prod-con with rss sampling"
   echo ""
@@ -10,11 +10,12 @@ if [[ $# -lt 1 ]]; then
   exit 1
 fi
 
-if [[ $# -ne 2 ]]; then
+if [[ $# -lt 2 ]]; then
   ALLOC="r"
 else
   ALLOC=$2
 fi
+REMOTE=$3
 
 BINARY=./prod-con_test
 if [ "$ALLOC" == "je" ]; then
@@ -24,7 +25,7 @@ fi
 THREADS=$1
 
 rm -f /tmp/prod-con
-$BINARY $THREADS 10000000 64 > /tmp/prod-con 
+$BINARY $THREADS 10000000 64 $REMOTE > /tmp/prod-con 
 
 while read line; do
   if [[ $line == *"Time elapsed"* ]]; then
@@ -33,5 +34,8 @@ while read line; do
   fi
 done < /tmp/prod-con
 
+# flush instruction Ralloc actually used, none for other allocators
+pwb=$(grep "Flush instruction" /tmp/prod-con | awk '{print $4}')
+
 echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC}"
-echo "$THREADS,$exec_time,$ALLOC" >> prod-con.csv
+echo "$THREADS,$exec_time,$ALLOC,${pwb:-none}" >> prod-con.csv
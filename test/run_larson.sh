@@ -1,9 +1,13 @@
 #!/bin/bash
-if [[ $# -ne 1 ]]; then
+if [[ $# -lt 1 ]]; then
   ALLOC="r"
 else
   ALLOC=$1
 fi
+# optional flush instruction of Ralloc, e.g., clwb, clflushopt or clflush
+if [[ $# -ge 2 ]]; then
+  export RALLOC_PWB=$2
+fi
 ARGS="ALLOC="
 ARGS=${ARGS}${ALLOC}
 echo $ARGS
@@ -11,7 +15,7 @@ echo $ARGS
 make clean
 make larson_test ${ARGS}
 rm -rf larson.csv
-echo "thread,ops,allocator" >> larson.csv
+echo "thread,ops,allocator,pwb" >> larson.csv
 for i in {1..3}
 do
 	for threads in 1 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
@@ -24,5 +28,5 @@ done
 # SEDARGS=${SEDARGS}","${ALLOC}"/"
 # echo $SEDARGS
 # sed ${SEDARGS} -i larson.csv
-NAME="../data/larson/larson_"${ALLOC}".csv"
+NAME="../data/larson/larson_"${ALLOC}${RALLOC_PWB:+_$RALLOC_PWB}".csv"
 cp larson.csv ${NAME}
@@ -1,9 +1,13 @@
 #!/bin/bash
-if [[ $# -ne 1 ]]; then
+if [[ $# -lt 1 ]]; then
   ALLOC="r"
 else
   ALLOC=$1
 fi
+# optional flush instruction of Ralloc, e.g., clwb, clflushopt or clflush
+if [[ $# -ge 2 ]]; then
+  export RALLOC_PWB=$2
+fi
 ARGS="ALLOC="
 ARGS=${ARGS}${ALLOC}
 echo $ARGS
@@ -11,7 +15,7 @@ echo $ARGS
 make clean
 make prod-con_test ${ARGS}
 rm -rf prod-con.csv
-echo "thread,exec_time,allocator" >> prod-con.csv
+echo "thread,exec_time,allocator,pwb" >> prod-con.csv
 for i in {1..3}
 do
 	for threads in 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
@@ -23,5 +27,5 @@ done
 # SEDARGS="2,\$s/$/"
 # SEDARGS=${SEDARGS}","${ALLOC}"/"
 # sed ${SEDARGS} -i prod-con.csv
-NAME="../data/prod-con/prod-con_"${ALLOC}".csv"
+NAME="../data/prod-con/prod-con_"${ALLOC}${RALLOC_PWB:+_$RALLOC_PWB}".csv"
 cp prod-con.csv ${NAME}
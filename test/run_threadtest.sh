@@ -1,16 +1,20 @@
 #!/bin/bash
-if [[ $# -ne 1 ]]; then
+if [[ $# -lt 1 ]]; then
   ALLOC="r"
 else
   ALLOC=$1
 fi
+# optional flush instruction of Ralloc, e.g., clwb, clflushopt or clflush
+if [[ $# -ge 2 ]]; then
+  export RALLOC_PWB=$2
+fi
 ARGS="ALLOC="
 ARGS=${ARGS}${ALLOC}
 echo $ARGS
 make clean
 make threadtest_test ${ARGS}
 rm -rf threadtest.csv
-echo "thread,exec_time,allocator" >> threadtest.csv
+echo "thread,exec_time,allocator,pwb" >> threadtest.csv
 for i in {1..3}
 do
 	for threads in 1 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
@@ -23,5 +27,5 @@ done
 # SEDARGS=${SEDARGS}","${ALLOC}"/"
 # echo $SEDARGS
 # sed ${SEDARGS} -i threadtest.csv
-NAME="../data/threadtest/threadtest_"${ALLOC}".csv"
+NAME="../data/threadtest/threadtest_"${ALLOC}${RALLOC_PWB:+_$RALLOC_PWB}".csv"
 cp threadtest.csv ${NAME}
@@ -39,5 +39,8 @@ while read line; do
   fi
 done < /tmp/shbench
 
+# flush instruction Ralloc actually used, none for other allocators
+pwb=$(grep "Flush instruction" /tmp/shbench | awk '{print $4}')
+
 echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC }"
-echo "$THREADS,$exec_time,$ALLOC" >> shbench.csv
+echo "$THREADS,$exec_time,$ALLOC,${pwb:-none}" >> shbench.csv
@@ -33,5 +33,8 @@ while read line; do
   fi
 done < /tmp/threadtest
 
+# flush instruction Ralloc actually used, none for other allocators
+pwb=$(grep "Flush instruction" /tmp/threadtest | awk '{print $4}')
+
 echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC}"
-echo "$THREADS,$exec_time,$ALLOC" >> threadtest.csv
+echo "$THREADS,$exec_time,$ALLOC,${pwb:-none}" >> threadtest.csv